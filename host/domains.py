@@ -0,0 +1,18 @@
+# Generated by gen_domains.py from domains.h, do not edit
+
+measuring_period = 12
+
+# Data domains
+d_pw         = 0
+d_pw_history = 1
+d_vbatt      = 2
+
+d_names            = ('pw', 'pw_history', 'vbatt')
+d_pages            = (200, 20, 4)
+d_first_page       = (0, 200, 220)
+d_measuring_period = (12, 3600, 600)
+d_input            = (0, 0, 2)
+d_bucket_values    = (1, 3, 1)
+d_scale            = (.2, .2, .0001)
+
+data_pages = 224
@@ -0,0 +1,60 @@
+#
+# Energy consumed per time of use tariff band and its cost. The bands are given
+# by the price and the local time hour ranges, the hours not covered by any band
+# are accounted separately. The transmitter energy counter readings kept in the
+# store are shown as well if any.
+#
+# Usage: python energy.py [file] [-<N>m|w|d|h] [-<band>=<price>@<h1>-<h2>[,<h3>-<h4>...]]...
+# e.g. python energy.py -1m -day=0.25@7-23 -night=0.12@23-7
+#
+
+import os
+from plot_common import *
+
+file, time_range, other = parse_pw_opts()
+
+bands = []
+for opt in other:
+	name, spec = opt.split('=')
+	price, ranges = spec.split('@')
+	band_hours = set()
+	for r in ranges.split(','):
+		h1, h2 = [int(h) % 24 for h in r.split('-')]
+		h = h1
+		while True:
+			band_hours.add(h)
+			h = (h + 1) % 24
+			if h == h2:
+				break
+	bands.append((name, float(price), sorted(band_hours)))
+
+T, D, E = load_energy(file, time_range)
+if not len(T):
+	print('no data')
+	sys.exit(1)
+
+Eh = np.bincount(hours(D), weights=E, minlength=24) / 1000.
+other_hours = set(range(24))
+total_cost = 0.
+print('%-10s %10s %10s' % ('band', 'kWh', 'cost'))
+for name, price, band_hours in bands:
+	kwh = Eh[band_hours].sum()
+	total_cost += kwh * price
+	other_hours -= set(band_hours)
+	print('%-10s %10.3f %10.2f' % (name, kwh, kwh * price))
+if other_hours or not bands:
+	print('%-10s %10.3f %10s' % ('other', Eh[sorted(other_hours)].sum(), '-'))
+print('%-10s %10.3f %10.2f' % ('total', Eh.sum(), total_cost))
+print('from %s to %s' % (D[0], D[-1]))
+
+if pwstore.is_series(file):
+	# The counter restarts with the transmitter so the readings are grouped by
+	# epoch. The energy metered between the first and the last download is shown.
+	tmin = T[0]
+	readings = {}
+	for t, epoch, wh in pwstore.Store(os.path.dirname(file) or '.').meter_readings():
+		if t >= tmin:
+			readings.setdefault(epoch, []).append(wh)
+	readings = [r for r in readings.values() if len(r) > 1]
+	if readings:
+		print('%-10s %10.3f' % ('metered', sum([max(r) - min(r) for r in readings]) / 1000.))
@@ -0,0 +1,220 @@
+#
+# Fake receiver serving the receiver UART protocol on the pseudo terminal so
+# pwmon may be run without the hardware. The transmitter history is made up
+# of synthetic pages with valid CRC, the last page of every domain is filled
+# partially. The transfers are completed instantly.
+#
+# Usage: python fake_receiver.py [--uptime=S] [--dev=N]
+# then run pwmon.py --port=<the printed path> with the usual options
+#
+
+import sys, os, tty, select, struct, math
+from pwmon import *
+
+def make_item(d, t):
+	if d == d_vbatt:
+		return int(3.8 / scale_vbatt)
+	return int((500 + 300 * math.sin(2 * math.pi * t / 86400)) / scale_pw)
+
+# The buckets per page and the values written per bucket, see history.c
+def bucket_layout(d):
+	if d_bucket_values[d] == 1:
+		return page_items, 1
+	return page_items // 4, 4
+
+def make_bucket(d, t):
+	v = make_item(d, t)
+	if d_bucket_values[d] == 1:
+		return [v]
+	return [v, v * 4 // 5, v * 13 // 10, page_item_invalid]
+
+def make_page(d, k, items):
+	sn = k * bucket_layout(d)[0] * d_measuring_period[d] // measuring_period
+	used = page_hdr_sz + page_item_sz * len(items)
+	unused_frags = 0
+	for f in range(page_frags):
+		if f * page_frag_sz >= used:
+			unused_frags |= 1 << f
+	body = struct.pack('%uH' % len(items), *items) + '\xff' * (page_item_sz * (page_items - len(items)))
+	hdr = page_hdr.pack(d, d_first_page[d] + k % d_pages[d], unused_frags, 0, sn)
+	return hdr + body + struct.pack('<I', crc32(body))
+
+# The energy counter in Wh as the transmitter accumulates it, see main.c
+def make_energy(uptime):
+	return sum([make_item(d_pw, t) for t in range(0, uptime, measuring_period)]) * measuring_period // (3600 * 5)
+
+# The report packet, see proto.h
+def make_report(dev, uptime):
+	sn = uptime // measuring_period
+	fmt = '<BBBBB3xIIHHI%ux' % ((data_pages + 7) // 8)
+	return struct.pack(fmt, struct.calcsize(fmt) - 1, 7, 0, 0, dev, 0x766f7661, sn,
+		make_item(d_pw, sn * measuring_period), make_item(d_vbatt, 0), make_energy(uptime))
+
+# The layout packet describing MAX_DOMAINS followed by CRC32, see proto.h.
+# The features are energy, min/max and the layout CRC.
+def make_layout(dev):
+	sz = 16 + 8 * struct.calcsize(domain_layout_fmt) + 4
+	r = struct.pack('<BBBBB3xIHBB', sz - 1, 7, 3, 0, dev, 0x766f7661, measuring_period, len(d_names), 7)
+	for l in default_layout.domains:
+		r += struct.pack(domain_layout_fmt, *l)
+	r += '\0' * (sz - 4 - len(r))
+	return r + struct.pack('<I', crc32(r))
+
+# The pages the transmitter keeps after running for the given time
+def make_history(uptime):
+	pages = []
+	for d in range(len(d_names)):
+		period = d_measuring_period[d]
+		per_page = bucket_layout(d)[0]
+		n = uptime // period
+		first = max(0, n // per_page - d_pages[d] + 1)
+		for k in range(first, n // per_page + 1):
+			cnt = min(per_page, n - k * per_page)
+			if cnt > 0:
+				pages.append(make_page(d, k, sum([make_bucket(d, (k * per_page + i) * period) for i in range(cnt)], [])))
+	return pages
+
+class FakeReceiver:
+	def __init__(self, fd, dev, uptime):
+		self.fd      = fd
+		self.dev     = dev
+		self.uptime  = uptime
+		self.history = make_history(uptime)
+		self.status  = x_none
+		self.pages   = []
+		self.credits = 0
+		self.stream  = False
+		self.hunt    = False # skipping input after the corrupted request
+
+	def send(self, sep, data):
+		os.write(self.fd, '~%04x%s' % (len(data), sep) + data)
+
+	def start(self):
+		self.status = x_completed
+		self.pages = self.history[:]
+
+	def page_frame(self):
+		r = chr(self.status)
+		if self.pages:
+			r += self.pages.pop(0)
+		return r
+
+	def stream_push(self):
+		while self.stream and self.credits:
+			r = self.page_frame()
+			self.send('C', r + struct.pack('<I', crc32(r)))
+			self.credits -= 1
+			if len(r) == 1:
+				self.stream = False
+
+	def text_command(self, cmd):
+		if cmd == 'a':
+			self.credits += 1
+			self.stream_push()
+			return
+		if cmd in ('v', '') or cmd[0] == 'b':
+			# any baud rate is fine for the pseudo terminal
+			self.send('\r', '\r')
+			return
+		name = cmd.rstrip('0123456789')
+		if cmd == 'r' or name not in ('u', 'l', 's', 'k', 'q', 'qd', 'p') or int(cmd[len(name):] or 0) != self.dev:
+			self.send('\r', 'fake receiver, transmitter #%u, %u pages\r' % (self.dev, len(self.history)))
+		elif name == 'u':
+			self.send('\r', '%u\r' % self.uptime)
+		elif name == 'l':
+			self.send('\r', 'measuring period = %u\r' % measuring_period)
+		elif name in ('s', 'k'):
+			self.start()
+			self.send('\r', '\r')
+		elif name == 'q':
+			self.send('B', chr(self.status))
+		elif name == 'qd':
+			self.send('B', self.page_frame())
+		elif name == 'p':
+			self.stream, self.credits = True, 3
+			self.stream_push()
+
+	def bin_command(self, op, req_id, payload):
+		err, r = 0, ''
+		if not payload or ord(payload[0]) != self.dev:
+			err = 3
+		elif op == op_status:
+			r = chr(self.status)
+		elif op == op_page:
+			r = self.page_frame()
+		elif op in (op_start, op_start_cached):
+			self.start()
+		elif op == op_uptime:
+			r = struct.pack('<I', self.uptime)
+		elif op == op_report:
+			r = struct.pack('<II', 1, 0) + make_report(self.dev, self.uptime)
+		elif op == op_layout:
+			r = make_layout(self.dev)
+		else:
+			err = 2
+		d = struct.pack(bin_hdr_fmt, op, req_id, err) + r
+		self.send('R', d + struct.pack('<I', crc32(d)))
+
+	# Process the commands received, returns the incomplete tail. The input is
+	# skipped till the next request or line end after the corrupted request as
+	# the receiver does, see uart.h.
+	def process(self, buff):
+		while buff:
+			if self.hunt:
+				if buff[0] in '~\r':
+					self.hunt = False
+				if buff[0] != '~':
+					buff = buff[1:]
+				continue
+			if buff[0] == '~':
+				if len(buff) < 1 + bin_hdr_sz:
+					break
+				op, req_id, sz = struct.unpack(bin_hdr_fmt, buff[1:1 + bin_hdr_sz])
+				end = 1 + bin_hdr_sz + sz + 4
+				if len(buff) < end:
+					break
+				d = buff[1:end - 4]
+				if crc32(d) != struct.unpack('<I', buff[end - 4:end])[0]:
+					r = struct.pack(bin_hdr_fmt, op, req_id, 1)
+					self.send('R', r + struct.pack('<I', crc32(r)))
+					self.hunt = True
+				else:
+					self.bin_command(op, req_id, d[bin_hdr_sz:])
+				buff = buff[end:]
+			else:
+				end = buff.find('\r')
+				if end < 0:
+					break
+				self.text_command(buff[:end])
+				buff = buff[end + 1:]
+		return buff
+
+rx_tout = .1 # binary request completion timeout, see uart.h
+
+def main():
+	dev, uptime = 0, 7 * 86400
+	for arg in sys.argv[1:]:
+		if arg.startswith('--dev='):
+			dev = int(arg[len('--dev='):])
+		elif arg.startswith('--uptime='):
+			uptime = int(arg[len('--uptime='):])
+		else:
+			print >> sys.stderr, 'invalid option %s' % arg
+			return 1
+
+	master, slave = os.openpty()
+	tty.setraw(slave)
+	print os.ttyname(slave)
+	sys.stdout.flush()
+
+	rcv, buff = FakeReceiver(master, dev, uptime), ''
+	while True:
+		# The incomplete binary request is dropped on timeout as the receiver does
+		tout = rx_tout if buff.startswith('~') else None
+		if not select.select([master], [], [], tout)[0]:
+			buff = ''
+			continue
+		buff = rcv.process(buff + os.read(master, 4096))
+
+if __name__ == '__main__':
+	sys.exit(main())
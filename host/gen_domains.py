@@ -0,0 +1,100 @@
+#
+# Generates the host decoder tables in domains.py from the data domains
+# description in src/modules/common/domains.h and the periods in proto.h.
+# The periods of the regular build are taken, not the TEST ones.
+#
+# Usage: python gen_domains.py [--check]
+# With --check the tables are not written, the exit code is non zero if they
+# are out of date.
+#
+
+import sys, os, re
+
+root   = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..')
+common = os.path.join(root, 'src', 'modules', 'common')
+output = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'domains.py')
+
+# The defines of proto.h skipping the TEST build branch
+def read_defines(path):
+	defs, skip = {}, []
+	with open(path) as f:
+		for line in f:
+			words = line.split()
+			if not words:
+				continue
+			if words[0] in ('#if', '#ifdef', '#ifndef'):
+				skip.append(words[0] == '#ifdef' and words[1] == 'TEST')
+			elif words[0] == '#else':
+				skip[-1] = not skip[-1]
+			elif words[0] == '#endif':
+				skip.pop()
+			elif words[0] == '#define' and len(words) > 2 and not any(skip):
+				defs[words[1]] = line.split('//')[0].split(None, 2)[2].strip()
+	return defs
+
+def evaluate(expr, defs):
+	while True:
+		e = re.sub(r'[A-Za-z_]\w*', lambda m: '(%s)' % defs[m.group(0)] if m.group(0) in defs else m.group(0), expr)
+		if e == expr:
+			return eval(e.replace('/', '//'))
+		expr = e
+
+def read_domains(path):
+	domains, inside = [], False
+	with open(path) as f:
+		for line in f:
+			if line.startswith('#define DATA_DOMAINS('):
+				inside = True
+			elif inside:
+				m = re.search(r'DOMAIN\(([^)]*)\)', line)
+				if m:
+					domains.append([w.strip() for w in m.group(1).split(',')])
+				if not line.rstrip().endswith('\\'):
+					break
+	return domains
+
+def generate():
+	defs = read_defines(os.path.join(common, 'proto.h'))
+	domains = read_domains(os.path.join(common, 'domains.h'))
+	ids = [d[0] for d in domains]
+	first, pages = [], 0
+	for d in domains:
+		first.append(pages)
+		pages += int(d[2])
+	lines = [
+		'# Generated by gen_domains.py from domains.h, do not edit',
+		'',
+		'measuring_period = %u' % evaluate('MEASURING_PERIOD', defs),
+		'',
+		'# Data domains',
+	]
+	lines += ['d_%-10s = %u' % (d[1], i) for i, d in enumerate(domains)]
+	lines += [
+		'',
+		'd_names            = (%s)' % ', '.join(["'%s'" % d[1] for d in domains]),
+		'd_pages            = (%s)' % ', '.join([d[2] for d in domains]),
+		'd_first_page       = (%s)' % ', '.join(['%u' % f for f in first]),
+		'd_measuring_period = (%s)' % ', '.join(['%u' % evaluate(d[3], defs) for d in domains]),
+		'd_input            = (%s)' % ', '.join(['%u' % ids.index(d[4]) for d in domains]),
+		'd_bucket_values    = (%s)' % ', '.join([d[5] for d in domains]),
+		'd_scale            = (%s)' % ', '.join([d[6] for d in domains]),
+		'',
+		'data_pages = %u' % pages,
+		'',
+	]
+	return '\n'.join(lines)
+
+def main():
+	text = generate()
+	if '--check' in sys.argv[1:]:
+		old = open(output).read() if os.path.exists(output) else ''
+		if old != text:
+			print('%s is out of date, run gen_domains.py' % output)
+			return 1
+		return 0
+	with open(output, 'w') as f:
+		f.write(text)
+	return 0
+
+if __name__ == '__main__':
+	sys.exit(main())
@@ -0,0 +1,122 @@
+#
+# Channel model for evaluating data transfer channel hopping.
+# The hop schedule and channel selection mirror hop.h and the receiver
+# implementation. The transfer is modelled as a sequence of data bursts
+# each one followed by report / data request exchange on the same channel.
+#
+# Usage: python hop_sim.py [--wifi=1] [--busy=.8] [--fragments=1792] [--seed=N]
+#
+
+import sys, random
+
+protocol_channel = 0
+
+hop_channels = (24, 25, 48, 49, 50, 74, 76, 78)
+hop_stride   = 3
+
+loss_one  = 256
+loss_max  = loss_one // 4
+loss_age  = 4
+loss_ewma = 2
+
+burst_max = 16 * 8 # fragments per burst (receiver buffers capacity)
+
+def hop_index(sn, n):
+	return (sn + n * hop_stride) % len(hop_channels)
+
+# Relative interference level outside of the Wi-Fi channel main lobe
+side_lobe = .25
+
+def wifi_center(wch):
+	return 12 + 5 * (wch - 1)
+
+class ChannelModel:
+	"""Per channel packet loss probability given the Wi-Fi channels in use"""
+	def __init__(self, wifi, busy, base_loss=.01):
+		self.loss = [base_loss] * 81
+		for w in wifi:
+			c = wifi_center(w)
+			for ch in range(81):
+				d = abs(ch - c)
+				if d <= 11:
+					self.loss[ch] += busy
+				elif d <= 22:
+					self.loss[ch] += busy * side_lobe
+				self.loss[ch] = min(1., self.loss[ch])
+
+	def delivered(self, ch, rnd):
+		return rnd.random() >= self.loss[ch]
+
+class HopSelector:
+	"""Receiver side channel selection"""
+	def __init__(self):
+		self.loss = [0] * len(hop_channels)
+		self.cnt = 0
+
+	def select(self, sn):
+		best, best_loss = 0, None
+		for n in range(len(hop_channels)):
+			i = hop_index(sn, self.cnt)
+			self.cnt += 1
+			if self.loss[i] < loss_max:
+				return i
+			if best_loss is None or self.loss[i] < best_loss:
+				best, best_loss = i, self.loss[i]
+			self.loss[i] -= self.loss[i] >> loss_age
+		return best
+
+	def account(self, i, requested, received):
+		loss = (requested - received) * loss_one // requested if requested else 0
+		self.loss[i] += (loss >> loss_ewma) - (self.loss[i] >> loss_ewma)
+
+def simulate(model, hopping, fragments, rnd):
+	"""Returns the number of packets transmitted and received to get all fragments"""
+	sel = HopSelector()
+	sent = received = 0
+	sn = 0
+	remaining = fragments
+	ch = protocol_channel
+	while remaining:
+		sn += 1
+		# report / data request handshake
+		sent += 2
+		if not model.delivered(ch, rnd) or not model.delivered(ch, rnd):
+			ch = protocol_channel
+			continue
+		received += 2
+		requested = min(remaining, burst_max)
+		i = None
+		if hopping:
+			i = sel.select(sn)
+			ch = hop_channels[i]
+		got = 0
+		for f in range(requested):
+			sent += 1
+			if model.delivered(ch, rnd):
+				got += 1
+		received += got
+		remaining -= got
+		if hopping:
+			sel.account(i, requested, got)
+	return sent, received
+
+def main():
+	wifi, busy, fragments, seed = (1,), .8, 224 * 8, 0
+	for arg in sys.argv[1:]:
+		if arg.startswith('--wifi='):
+			wifi = [int(w) for w in arg[7:].split(',') if w]
+		elif arg.startswith('--busy='):
+			busy = float(arg[7:])
+		elif arg.startswith('--fragments='):
+			fragments = int(arg[12:])
+		elif arg.startswith('--seed='):
+			seed = int(arg[7:])
+	model = ChannelModel(wifi, busy)
+	for hopping in (False, True):
+		sent, received = simulate(model, hopping, fragments, random.Random(seed))
+		print '%-8s %6u packets sent, %6u received, goodput %.1f%%' % (
+				'hopping' if hopping else 'fixed', sent, received, 100. * fragments / sent
+			)
+
+if __name__ == '__main__':
+	main()
@@ -5,8 +5,9 @@ from plot_common import *
 
 file, time_range, _ = parse_pw_opts()
 
-T, D, Y = load(file, time_range)
+T, D, Y, Ymin, Ymax = load_rollup(file, time_range)
 
+plt.fill_between(D, Ymin, Ymax, color='lightgray', linewidth=0)
 plt.plot(D, Y)
 plt.show()
 
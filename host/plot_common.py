@@ -1,29 +1,77 @@
 import sys
 import time
-from datetime import datetime
+import calendar
+import pwstore
+import numpy as np
 
 week_day_names = ['mon', 'tue', 'wed', 'thu', 'fri', 'sat', 'sun']
 week_day_colors = ['y', 'g', 'b', 'c', 'olive', 'm', 'r']
 
+# Returns the local time seconds, the same as datetime.fromtimestamp() gives.
+# The UTC offset is looked up once per hour since the DST is switched on the
+# hour boundary.
+def local_time(T):
+	H, inv = np.unique(T // 3600, return_inverse=True)
+	off = np.array([calendar.timegm(time.localtime(h)) - h for h in (H * 3600).tolist()], dtype=np.int64)
+	return T + off[inv]
+
+# The file is either the text one saved by pwmon --save-data or the store
+# series like pwdata/pw. Returns the timestamps, the local times as datetime64
+# and the values as numpy arrays.
 def load(file, time_range = None):
 	now = time.time()
 	tmin = now - time_range if time_range is not None else 0.
-	T, D, Y = [], [], []
-	with open(file, 'r') as f:
-		for line in f.readlines():
-			words = line.split()
-			if len(words) == 2:
-				t = int(words[0])
-				y = float(words[1])
-				if t > tmin: 
-					d = datetime.fromtimestamp(t)
-					T.append(t)
-					D.append(d)
-					Y.append(y)
-	return T, D, Y
+	if pwstore.is_series(file):
+		T, Y = pwstore.load(file, tmin)
+	else:
+		T, Y = [], []
+		with open(file, 'r') as f:
+			for line in f.readlines():
+				words = line.split()
+				if len(words) == 2:
+					t = int(words[0])
+					if t > tmin:
+						T.append(t)
+						Y.append(float(words[1]))
+		T, Y = np.array(T, dtype=np.int64), np.array(Y)
+	return T, local_time(T).astype('datetime64[s]'), Y
+
+# The number of points the time plot resolution is chosen for
+plot_points = 4000
+
+# Same as load() but returns the mean, min and max values per bucket of the
+# store rollup tier, the coarsest one giving at least plot_points for the time
+# range requested. The text file items are returned as they are.
+def load_rollup(file, time_range = None):
+	if not pwstore.is_series(file):
+		T, D, Y = load(file, time_range)
+		return T, D, Y, Y, Y
+	tmin = time.time() - time_range if time_range is not None else 0.
+	s = pwstore.open_series(file)
+	T, C, Y, Ymin, Ymax = s.rollup(tmin, s.span(tmin) // plot_points)
+	return T, local_time(T).astype('datetime64[s]'), Y, Ymin, Ymax
+
+# Returns the timestamps, local times and the energy in Wh consumed over the
+# hourly store rollup buckets or the text file items. The item period of the
+# text file is taken as the typical interval between the items.
+def load_energy(file, time_range = None):
+	if pwstore.is_series(file):
+		tmin = time.time() - time_range if time_range is not None else 0.
+		s = pwstore.open_series(file)
+		T, C, Y, Ymin, Ymax = s.rollup(tmin, 3600)
+		E = Y * C * s.period / 3600.
+	else:
+		T, D, Y = load(file, time_range)
+		E = Y * (np.median(np.diff(T)) if len(T) > 1 else 0) / 3600.
+	return T, local_time(T).astype('datetime64[s]'), E
+
+# The store is used if pwmon --store has created it
+def default_file(name):
+	series = 'pwdata/' + name
+	return series if pwstore.is_series(series) else name + '.dat'
 
 def parse_pw_history_opts():
-	file = 'pw_history.dat'
+	file = default_file('pw_history')
 	time_range = None
 	other_opts = []
 	for opt in sys.argv[1:]:
@@ -44,7 +92,7 @@ def parse_pw_history_opts():
 	return file, time_range, other_opts
 
 def parse_pw_opts():
-	file = 'pw.dat'
+	file = default_file('pw')
 	time_range = None
 	other_opts = []
 	for opt in sys.argv[1:]:
@@ -66,46 +114,41 @@ def parse_pw_opts():
 			file = opt
 	return file, time_range, other_opts
 
+# The aggregation is done on the local times D returned by load()
+def hours(D):
+	return D.astype(np.int64) // 3600 % 24
+
+def weekdays(D):
+	# 1970-01-01 is thursday
+	return (D.astype(np.int64) // 86400 + 3) % 7
+
+# The mean value per bin, nan for the empty ones
+def bin_means(bins, Y, n):
+	Tot = np.bincount(bins, weights=Y, minlength=n)
+	Cnt = np.bincount(bins, minlength=n)
+	with np.errstate(divide='ignore', invalid='ignore'):
+		return Tot / Cnt
+
 def get_hist_h(D, Y):
-	Tot, Cnt = [0.] * 24, [0] * 24
-	for d, y in zip(D, Y):
-		Cnt[d.hour] += 1
-		Tot[d.hour] += y
-	return [Tot[i] / Cnt[i] for i in range(24)]
+	return bin_means(hours(D), Y, 24)
 
 def get_hist_w(D, Y):
-	Tot, Cnt = [0.] * 7, [0] * 7
-	for d, y in zip(D, Y):
-		w = d.weekday()
-		Cnt[w] += 1
-		Tot[w] += y
-	return [Tot[i] / Cnt[i] for i in range(7)]
+	return bin_means(weekdays(D), Y, 7)
 
 def get_hist_hw(D, Y):
-	Tot, Cnt = [[0.] * 24 for day in range(7)], [[0] * 24 for day in range(7)]
-	for d, y in zip(D, Y):
-		w = d.weekday()
-		Cnt[w][d.hour] += 1
-		Tot[w][d.hour] += y
-	return [[Tot[day][i] / Cnt[day][i] for i in range(24)] for day in range(7)]
+	return bin_means(weekdays(D) * 24 + hours(D), Y, 7 * 24).reshape(7, 24)
 
 def get_pw_distr(Y, ymax=4000., bins=1000):
-	Btot, cnt = [0.] * bins, 0
 	step = ymax / bins
-	for y in Y:
-		bin = min(int(y / step), bins-1)
-		Btot[bin] += y
-		cnt += 1
-	Tot = sum(Btot)
-	B = [step * i for i in range(bins + 1)]
-	D = [0.] * (bins + 1)
-	if not cnt:
+	B = step * np.arange(bins + 1)
+	D = np.zeros(bins + 1)
+	if not len(Y):
 		return B, D
-	D[0] = Tot/cnt
-	for i in range(bins):
-		Tot -= Btot[i]
-		D[i+1] = max(Tot/cnt, 0.)
-	return B, D
+	Btot = np.bincount(np.minimum((Y / step).astype(np.int64), bins-1), weights=Y, minlength=bins)
+	Tot = np.sum(Btot)
+	D[0] = Tot
+	D[1:] = np.maximum(Tot - np.cumsum(Btot), 0.)
+	return B, D / len(Y)
 
 def select_weekday(D, Y, wd):
-	 return [y for d, y in zip(D, Y) if d.weekday() == wd]
+	return Y[weekdays(D) == wd]
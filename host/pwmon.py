@@ -1,10 +1,14 @@
-import sys, serial, time, struct
+import sys, serial, time, struct, array
 from serial.tools.list_ports import comports
 from collections import namedtuple
 
 valid_controllers   = ['USB VID:PID=0403:6001', 'FTDIBUS\\VID_0403+PID_6001', 'USB VID:PID=10C4:EA60']
 controller_baudrate = 230400
 controller_timeout  = 1
+# Baud rates to try before retrieving data, the fastest first
+controller_fast_baudrates = (1000000, 921600, 460800)
+# The receiver restores baud rate if it is not confirmed in 1 sec
+controller_baud_restore_tout = 1.1
 
 #----------- Core communication functions --------------------
 
@@ -21,19 +25,64 @@ def open_port(port):
 def bin2hex(resp):
 	return ' '.join(['%02x' % ord(c) for c in resp])
 
-def read_response(com, printable=False):
+# CRC32 used by the receiver (Castagnoli polynomial, see crc32.c). The data
+# is processed by 8 bytes with the slice by 8 tables which takes half the
+# time of the byte by byte loop.
+def make_crc32_tables():
+	tab = []
+	for i in range(256):
+		c = i
+		for _ in range(8):
+			c = (c >> 1) ^ 0x82f63b78 if c & 1 else c >> 1
+		tab.append(c)
+	tabs = [tab]
+	for _ in range(7):
+		tabs.append([(c >> 8) ^ tab[c & 0xff] for c in tabs[-1]])
+	return tabs
+
+crc32_tables = make_crc32_tables()
+
+def crc32(data):
+	t0, t1, t2, t3, t4, t5, t6, t7 = crc32_tables
+	crc = 0xffffffff
+	n = len(data) & ~7
+	words = struct.unpack('<%uI' % (n // 4), data[:n])
+	for i in range(0, len(words), 2):
+		crc ^= words[i]
+		w = words[i+1]
+		crc = t7[crc & 0xff] ^ t6[(crc >> 8) & 0xff] ^ t5[(crc >> 16) & 0xff] ^ t4[crc >> 24] ^ \
+			t3[w & 0xff] ^ t2[(w >> 8) & 0xff] ^ t1[(w >> 16) & 0xff] ^ t0[w >> 24]
+	for c in data[n:]:
+		crc = t0[(crc ^ ord(c)) & 0xff] ^ (crc >> 8)
+	return crc ^ 0xffffffff
+
+def read_frame(com, wait=False):
 	prefix = com.read(6)
+	if wait:
+		while len(prefix) == 0:
+			prefix = com.read(6)
 	if len(prefix) == 0:
 		raise RuntimeError('failed to read response')
+	if len(prefix) < 6:
+		prefix += com.read(6 - len(prefix))
 	if len(prefix) != 6 or prefix[0:1] != '~':
 		raise RuntimeError('invalid prefix: %s' % prefix)
 	sz = int(prefix[1:5], base=16)
 	resp = com.read(sz)
 	if len(resp) != sz:
 		raise RuntimeError('invalid response: %s' % resp)
+	return prefix[5], resp
+
+# The long text response is split onto several frames with + separator but
+# the last one
+def read_response(com, printable=False):
+	sep, resp = read_frame(com)
+	while sep == '+':
+		sep, part = read_frame(com)
+		resp += part
 	if not printable:
 		return resp
-	if prefix[5] == 'B':
+	if sep == 'B':
 		return bin2hex(resp)
 	else:
 		return resp.replace('\r', '\n')
@@ -46,6 +95,78 @@ def send_text_command(com, cmd):
 	com.write(cmd + '\r')
 	return read_response(com, printable=True)
 
+# Binary requests: ~, operation code, request id, payload length, payload, CRC32.
+# The response is framed with R separator and has operation code, request id,
+# error code, the result and CRC32. The requests may be sent without waiting for
+# the responses to the previous ones.
+op_status = 1
+op_page   = 2
+op_start  = 3
+op_uptime = 4
+op_report = 5
+op_stat   = 6
+op_start_cached = 7
+op_layout = 8
+
+bin_hdr_fmt = 'BBB'
+bin_hdr_sz  = struct.calcsize(bin_hdr_fmt)
+
+err_op      = 2
+err_no_data = 5
+bin_errors = ('ok', 'corrupted request', 'unknown operation', 'invalid transmitter id', 'too many transfers', 'no data')
+
+def bin_request(op, req_id, payload=''):
+	d = struct.pack(bin_hdr_fmt, op, req_id, len(payload)) + payload
+	return '~' + d + struct.pack('<I', crc32(d))
+
+def read_bin_response(com):
+	sep, resp = read_frame(com)
+	if sep != 'R' or len(resp) < bin_hdr_sz + 4:
+		raise RuntimeError('invalid binary response')
+	data, crc = resp[:-4], struct.unpack('<I', resp[-4:])[0]
+	if crc32(data) != crc:
+		raise RuntimeError('binary response CRC mismatch')
+	op, req_id, err = struct.unpack(bin_hdr_fmt, data[:bin_hdr_sz])
+	return op, req_id, err, data[bin_hdr_sz:]
+
+def check_bin_response(resp, op, req_id):
+	if resp[0] != op or resp[1] != req_id:
+		raise RuntimeError('unexpected response %u #%u' % resp[:2])
+	if resp[2]:
+		raise RuntimeError(bin_errors[resp[2]] if resp[2] < len(bin_errors) else 'error %u' % resp[2])
+	return resp[3]
+
+def bin_transact(com, op, payload=''):
+	com.write(bin_request(op, 0, payload))
+	return check_bin_response(read_bin_response(com), op, 0)
+
+# Switch receiver to the new baud rate. The receiver answers at the current rate
+# and waits for confirmation at the new one. Returns False if the rate is not
+# supported by either side, the port is left at the current rate then.
+def set_baudrate(com, baudrate):
+	prev_baudrate = com.baudrate
+	if send_command(com, 'b%u' % baudrate) != '\r':
+		return False
+	com.flush()
+	try:
+		com.baudrate = baudrate
+		com.reset_input_buffer()
+		com.write('v\r')
+		if read_frame(com) == ('\r', '\r'):
+			return True
+	except (RuntimeError, ValueError, serial.SerialException):
+		pass
+	com.baudrate = prev_baudrate
+	time.sleep(controller_baud_restore_tout)
+	com.reset_input_buffer()
+	return False
+
+def set_fast_baudrate(com):
+	for baudrate in controller_fast_baudrates:
+		if set_baudrate(com, baudrate):
+			return baudrate
+	return com.baudrate
+
 #------- Data reading ------------------------------------
 
 # Transfer status
@@ -56,103 +177,230 @@ x_reading_data = 3
 x_completed    = 4
 x_failed       = 5
 
-# Data domains
-d_pw         = 0
-d_pw_history = 1
-d_vbatt      = 2
-
-# Data scaling
-scale_pw    = .2
-scale_vbatt = .0001
-
-# Scales per domain
-d_scale = (scale_pw, scale_pw, scale_vbatt)
-
-# Measuring period
-measuring_period = 12
-
-# Measuring period per domain
-d_measuring_period = (measuring_period, 3600, 600)
+# Data domains, their periods and scales, see domains.h. The slow power domain
+# keeps the mean, min and max per bucket, the erased value padding its bucket
+# is dropped on parsing.
+from domains import *
+
+scale_pw    = d_scale[d_pw]
+scale_vbatt = d_scale[d_vbatt]
+
+# The data layout advertised by the transmitter, see struct layout_packet.
+# The tables generated from domains.h are used till the receiver gets it.
+Layout = namedtuple('Layout', ('measuring_period', 'features', 'domains'))
+DomainLayout = namedtuple('DomainLayout', ('period', 'scale', 'first_page', 'pages', 'input', 'values'))
+layout_fmt        = '<12xHBB'
+domain_layout_fmt = '<IfBBBB'
+
+default_layout = Layout(measuring_period, 0, tuple([
+		DomainLayout(d_measuring_period[d], d_scale[d], d_first_page[d], d_pages[d], d_input[d], d_bucket_values[d])
+		for d in range(len(d_names))
+	]))
+
+# The store series names per domain bucket value, the domains unknown to the
+# host are named by their index
+def domain_series(layout=default_layout):
+	series = []
+	for d, l in enumerate(layout.domains):
+		n = d_names[d] if d < len(d_names) else 'domain%u' % d
+		series.append((n,) if l.values == 1 else (n, n + '_min', n + '_max'))
+	return tuple(series)
 
 DataPage = namedtuple('DataPage', ('domain', 'page_idx', 'sn', 'data'))
 
 page_sz           = 1024
-page_frag_sz      = page_sz // 8
+page_frags        = 8
+page_frag_sz      = page_sz // page_frags
 page_hdr_fmt      = 'BBBBI'
-page_hdr_sz       = struct.calcsize(page_hdr_fmt)
+page_hdr          = struct.Struct(page_hdr_fmt)
+page_hdr_sz       = page_hdr.size
+page_crc_sz       = 4
 page_item_fmt     = 'H'
 page_item_sz      = struct.calcsize(page_item_fmt)
-page_items        = (page_sz - page_hdr_sz) // page_item_sz
-page_frag_items   = page_frag_sz // page_item_sz
-page_hdr_items    = page_hdr_sz  // page_item_sz
+page_items        = (page_sz - page_hdr_sz - page_crc_sz) // page_item_sz
 page_item_invalid = 0xffff
 
+# The page ends with CRC32 of the items computed by the transmitter
+def check_data_page(d):
+	crc = struct.unpack('<I', d[-page_crc_sz:])[0]
+	if crc32(d[page_hdr_sz:-page_crc_sz]) != crc:
+		raise RuntimeError('data page CRC mismatch')
+	return d
+
+# The items of the used fragments are converted at once, the ones not written
+# yet are dropped
 def parse_data_page(d):
-	hdr          = struct.unpack(page_hdr_fmt, d[:page_hdr_sz])
-	items        = struct.unpack(page_item_fmt * page_items, d[page_hdr_sz:])
-	unused_frags = hdr[2]
+	domain, page_idx, unused_frags, _, sn = page_hdr.unpack_from(d)
+	items = array.array(page_item_fmt)
+	for f in range(page_frags):
+		if not (1 << f) & unused_frags:
+			items.fromstring(d[max(f * page_frag_sz, page_hdr_sz) : min((f + 1) * page_frag_sz, page_sz - page_crc_sz)])
 	return DataPage(
-				domain   = hdr[0],
-				page_idx = hdr[1],
-				sn       = hdr[-1],
-				data     = [
-							it for j, it in enumerate(items) if
-								not ((1 << ((page_hdr_items + j) // page_frag_items)) & unused_frags) and
-								it != page_item_invalid
-						]
+				domain   = domain,
+				page_idx = page_idx,
+				sn       = sn,
+				data     = [it for it in items if it != page_item_invalid]
 			)
 
-def get_transmitter_uptime(com):
-	return int(send_command(com, 'u'))
-
-def get_transmitter_start_time(com):
-	return int(time.time()) - get_transmitter_uptime(com)
-
-def start_transfer(com):
-	r = send_command(com, 's')
+# Returns the page with the given value of every domain bucket only
+def page_values(p, j, layout=default_layout):
+	n = layout.domains[p.domain].values
+	if n == 1:
+		return p
+	return p._replace(data=p.data[j:len(p.data) // n * n:n])
+
+def get_transmitter_uptime(com, dev=0):
+	return int(send_command(com, 'u%u' % dev))
+
+# The last report received from the transmitter, see struct report_packet
+Report = namedtuple('Report', ('packets', 'age', 'status', 'sn', 'power', 'vbatt', 'energy'))
+report_hdr_fmt = '<II'
+report_fmt     = '<3xB8xIHHI'
+
+def get_transmitter_report(com, dev=0):
+	r = bin_transact(com, op_report, chr(dev))
+	packets, age = struct.unpack_from(report_hdr_fmt, r)
+	status, sn, power, vbatt, energy = struct.unpack_from(report_fmt, r, struct.calcsize(report_hdr_fmt))
+	return Report(packets, age, status, sn, power * scale_pw, vbatt * scale_vbatt, energy)
+
+# Returns the default layout if the receiver has not got one from the transmitter yet
+def get_transmitter_layout(com, dev=0):
+	com.write(bin_request(op_layout, 0, chr(dev)))
+	resp = read_bin_response(com)
+	if resp[2] in (err_op, err_no_data):
+		print >> sys.stderr, 'transmitter layout is unknown, using the default one'
+		return default_layout
+	r = check_bin_response(resp, op_layout, 0)
+	period, ndomains, features = struct.unpack_from(layout_fmt, r)
+	off = struct.calcsize(layout_fmt)
+	sz = struct.calcsize(domain_layout_fmt)
+	domains = []
+	for d in range(ndomains):
+		l = DomainLayout(*struct.unpack_from(domain_layout_fmt, r, off + d * sz))
+		# the scale is sent as float, restore the decimal one
+		domains.append(l._replace(scale=float('%.7g' % l.scale)))
+	return Layout(period, features, tuple(domains))
+
+def get_transmitter_start_time(com, dev=0):
+	return int(time.time()) - get_transmitter_uptime(com, dev)
+
+# The cached transfer serves the pages the receiver has already downloaded
+# without the radio
+def start_transfer(com, dev=0, cached=False):
+	r = send_command(com, ('k%u' if cached else 's%u') % dev)
 	if r != '\r':
 		raise RuntimeError('invalid response: %s' % r)
 
-def query_data_page(com):
-	r = send_command(com, 'qd')
-	if len(r) == 1:
-		return ord(r[0]), None
-	if len(r) != 1 + page_sz:
-		raise RuntimeError('invalid data length: %u bytes' % len(r))
-	return ord(r[0]), r[1:]
+def query_data_page(com, dev=0):
+	return parse_page_response(send_command(com, 'qd%u' % dev))
 
-def retrieve_data_raw(com, status_cb=None):
-	start_transfer(com)
+def poll_data_raw(com, status_cb=None, dev=0):
 	pages = []
 	while True:
-		sta, data = query_data_page(com)
+		sta, data = query_data_page(com, dev)
 		if status_cb is not None:
 			status_cb(sta)
 		if data is not None:
-			pages.append(data)
+			pages.append(check_data_page(data))
 		else:
 			if sta == x_failed:
 				raise RuntimeError('data transfer failed')
 			if sta == x_completed:
 				return pages
 
-def retrieve_data_pages(com, status_cb=None):
-	raw_pages = retrieve_data_raw(com, status_cb)
+def parse_page_response(r):
+	if len(r) == 1:
+		return ord(r[0]), None
+	if len(r) != 1 + page_sz:
+		raise RuntimeError('invalid data length: %u bytes' % len(r))
+	return ord(r[0]), r[1:]
+
+# Keep the given number of page requests outstanding so the receiver does not
+# wait for the host between pages
+def poll_data_bin(com, status_cb=None, dev=0, pipeline=4):
+	pages, req_id, resp_id = [], 0, 0
+	for req_id in range(pipeline):
+		com.write(bin_request(op_page, req_id, chr(dev)))
+	req_id = pipeline
+	while True:
+		r = check_bin_response(read_bin_response(com), op_page, resp_id)
+		resp_id = (resp_id + 1) & 0xff
+		sta, data = parse_page_response(r)
+		if status_cb is not None:
+			status_cb(sta)
+		if data is not None:
+			pages.append(check_data_page(data))
+		elif sta in (x_none, x_completed, x_failed):
+			break
+		com.write(bin_request(op_page, req_id, chr(dev)))
+		req_id = (req_id + 1) & 0xff
+	# Drain the responses to the requests still outstanding
+	while resp_id != req_id:
+		read_bin_response(com)
+		resp_id = (resp_id + 1) & 0xff
+	if sta != x_completed:
+		raise RuntimeError('data transfer failed')
+	return pages
+
+# The receiver pushes frames with transfer status and data page while we
+# acknowledge every frame received. The stream is terminated by the frame
+# without data page having the final status.
+def read_stream_frame(com):
+	sep, resp = read_frame(com, wait=True)
+	if sep != 'C' or len(resp) < 5:
+		raise RuntimeError('invalid stream frame')
+	data, crc = resp[:-4], struct.unpack('<I', resp[-4:])[0]
+	if crc32(data) != crc:
+		raise RuntimeError('stream frame CRC mismatch')
+	if len(data) != 1 and len(data) != 1 + page_sz:
+		raise RuntimeError('invalid data length: %u bytes' % (len(data) - 1))
+	return ord(data[0]), data[1:] if len(data) > 1 else None
+
+def stream_data_raw(com, status_cb=None, dev=0):
+	com.write('p%u\r' % dev)
+	pages = []
+	while True:
+		sta, data = read_stream_frame(com)
+		if status_cb is not None:
+			status_cb(sta)
+		if data is not None:
+			pages.append(check_data_page(data))
+		elif sta in (x_none, x_completed, x_failed):
+			break
+		com.write('a\r')
+	if sta != x_completed:
+		raise RuntimeError('data transfer failed')
+	return pages
+
+# The pages are streamed by default, polled by text queries if poll is set or
+# by binary requests if the pipeline depth is given
+def retrieve_data_raw(com, status_cb=None, dev=0, poll=False, pipeline=0, cached=False):
+	start_transfer(com, dev, cached)
+	if pipeline:
+		return poll_data_bin(com, status_cb, dev, pipeline)
+	if poll:
+		return poll_data_raw(com, status_cb, dev)
+	return stream_data_raw(com, status_cb, dev)
+
+def retrieve_data_pages(com, status_cb=None, dev=0, pipeline=0, cached=False):
+	raw_pages = retrieve_data_raw(com, status_cb, dev, pipeline=pipeline, cached=cached)
 	return [parse_data_page(p) for p in raw_pages]
 
-def retrieve_data(com, status_cb=None):
-	d_pages = {d_pw : [], d_pw_history : [], d_vbatt : []}
-	d_data  = {d_pw : [], d_pw_history : [], d_vbatt : []}
-	ts = get_transmitter_start_time(com)
-	pages = retrieve_data_pages(com, status_cb)
+# The item times are derived from the transmitter layout
+def retrieve_data(com, status_cb=None, dev=0, pipeline=0, cached=False):
+	layout = get_transmitter_layout(com, dev)
+	d_pages = dict([(d, []) for d in range(len(layout.domains))])
+	d_data  = dict([(d, []) for d in range(len(layout.domains))])
+	ts = get_transmitter_start_time(com, dev)
+	pages = retrieve_data_pages(com, status_cb, dev, pipeline, cached)
 	for p in pages:
 		d_pages[p.domain].append(p)
 	for d, pgs in d_pages.items():
-		data, scale, period = d_data[d], d_scale[d], d_measuring_period[d]
+		data, scale, period = d_data[d], layout.domains[d].scale, layout.domains[d].period
 		pgs.sort(key = lambda p: p.sn)
 		for p in pgs:
-			toff  = ts + p.sn * measuring_period
-			for i, v in enumerate(p.data):
+			toff  = ts + p.sn * layout.measuring_period
+			for i, v in enumerate(page_values(p, 0, layout).data):
 				data.append((toff + i * period, v * scale))
 	return d_data
 
@@ -174,50 +422,123 @@ def get_status_cb():
 
 	return status_cb
 
-def get_raw_pages(com):
-	pages = retrieve_data_raw(com, get_status_cb())
+def get_raw_pages(com, dev, pipeline, cached):
+	pages = retrieve_data_raw(com, get_status_cb(), dev, pipeline=pipeline, cached=cached)
 	for pg in pages:
 		print bin2hex(pg)
 
-def get_pages(com):
-	pages = retrieve_data_pages(com, get_status_cb())
+def get_pages(com, dev, pipeline, cached):
+	pages = retrieve_data_pages(com, get_status_cb(), dev, pipeline, cached)
 	for pg in pages:
 		print pg
 
-def save_data(com, names):
-	data = retrieve_data(com, get_status_cb())
+def save_data(com, names, dev, pipeline, cached):
+	data = retrieve_data(com, get_status_cb(), dev, pipeline, cached)
 	for d, items in data.items():
+		if d >= len(names):
+			continue
 		with open(names[d], 'w') as f:
 			for t, v in items:
 				print >> f, t, v
 
+# Merge the data retrieved into the store, see pwstore.py
+def store_data(com, path, dev, pipeline, cached):
+	import pwstore
+	layout = get_transmitter_layout(com, dev)
+	ts = get_transmitter_start_time(com, dev)
+	pages = retrieve_data_pages(com, get_status_cb(), dev, pipeline, cached)
+	store = pwstore.Store(path)
+	names, domains = [], []
+	for d, series in enumerate(domain_series(layout)):
+		l, pgs = layout.domains[d], [p for p in pages if p.domain == d]
+		for j, name in enumerate(series):
+			names.append(name)
+			domains.append((store.series(name, l.period, l.scale), [page_values(p, j, layout) for p in pgs]))
+	nepochs = len(store.epochs)
+	epoch, ts = store.epoch(ts, domains)
+	if nepochs and epoch >= nepochs:
+		print >> sys.stderr, 'transmitter restarted, new epoch %u' % epoch
+	for name, (s, pgs) in zip(names, domains):
+		added = s.merge(epoch, ts, layout.measuring_period, pgs)
+		print >> sys.stderr, '%s: %u items added, %u total' % (name, added, len(s))
+	r = get_transmitter_report(com, dev)
+	store.add_meter_reading(int(time.time()) - r.age, epoch, r.energy)
+	print >> sys.stderr, 'energy: %.3f kWh' % (r.energy / 1000.)
+
 def main():
-	port = find_port()
+	args = sys.argv[1:]
+
+	# The receiver port may be given explicitly, e.g. the one of fake_receiver.py: --port=PATH
+	port = None
+	for arg in args[:]:
+		if arg.startswith('--port='):
+			port = arg[len('--port='):]
+			args.remove(arg)
+	if port is None:
+		port = find_port()
 	if not port:
 		print 'receiver not found'
 		return -1
 
 	com = open_port(port)
-	if len(sys.argv) <= 1:
+	if not args:
 		print send_text_command(com, 'r')
 		return 0
 
-	args = sys.argv[1:]
-
-	if '--get-raw-pages' in args:
-		get_raw_pages(com)
-		return 0
-
-	if '--get-pages' in args:
-		get_pages(com)
-		return 0
-
-	if '--save-data' in args:
-		if len(args) == 4:
-			args.remove('--save-data')
-			save_data(com, args)
-		else:
-			save_data(com, ('pw.dat', 'pw_history.dat', 'vbatt.dat'))
+	# Transmitter selection: --dev=N
+	# Data retrieval baud rate: --baud=N, the fastest supported one by default
+	# Retrieve data by N pipelined binary requests instead of streaming: --pipeline=N
+	# Retrieve the pages cached by receiver without the radio: --cached
+	dev, baudrate, pipeline, cached = 0, None, 0, False
+	for arg in args[:]:
+		if arg.startswith('--dev='):
+			dev = int(arg[len('--dev='):])
+			args.remove(arg)
+		elif arg.startswith('--baud='):
+			baudrate = int(arg[len('--baud='):])
+			args.remove(arg)
+		elif arg.startswith('--pipeline='):
+			pipeline = int(arg[len('--pipeline='):])
+			args.remove(arg)
+		elif arg == '--cached':
+			cached = True
+			args.remove(arg)
+
+	# Merge data into the store directory: --store[=DIR], pwdata by default
+	store = 'pwdata'
+	for arg in args[:]:
+		if arg.startswith('--store='):
+			store = arg[len('--store='):]
+			args.remove(arg)
+			args.append('--store')
+
+	for cmd in ('--get-raw-pages', '--get-pages', '--save-data', '--store'):
+		if cmd in args:
+			break
+	else:
+		cmd = None
+
+	if cmd is not None:
+		if baudrate is None:
+			set_fast_baudrate(com)
+		elif baudrate != com.baudrate and not set_baudrate(com, baudrate):
+			print >> sys.stderr, 'failed to switch to %u baud' % baudrate
+		try:
+			if cmd == '--get-raw-pages':
+				get_raw_pages(com, dev, pipeline, cached)
+			elif cmd == '--get-pages':
+				get_pages(com, dev, pipeline, cached)
+			elif cmd == '--store':
+				store_data(com, store, dev, pipeline, cached)
+			elif len(args) == 4:
+				args.remove('--save-data')
+				save_data(com, args, dev, pipeline, cached)
+			else:
+				save_data(com, [name + '.dat' for name in d_names], dev, pipeline, cached)
+		finally:
+			# The receiver keeps the rate till restart, return it to default
+			if com.baudrate != controller_baudrate:
+				set_baudrate(com, controller_baudrate)
 		return 0
 
 	for arg in args:
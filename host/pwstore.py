@@ -0,0 +1,365 @@
+#
+# Append only store for the downloaded history. Every data domain is kept as
+# the series of two files in the store directory:
+#  <name>.val - raw 16 bit items as they are stored in the data pages
+#  <name>.idx - header followed by the block records
+# The block is the run of items taken from the single page. The items are
+# measured with the fixed period so the block record keeps the timestamp of the
+# first item only. The records are written after the items they refer to so
+# the series interrupted while being written stays consistent. The items
+# already stored are skipped on merging new pages by their sequence numbers.
+#
+# The sequence numbers restart on the transmitter reboot so the store keeps
+# the list of epochs in the epochs file, one transmitter start time per line.
+# The pages are identified by the epoch index and the sequence number, the
+# item timestamps are counted from the epoch start time as estimated by the
+# download merging the page.
+#
+# The transmitter energy counter readings taken on every download are kept in
+# the energy file as the lines with the reading time, the epoch and Wh.
+#
+# The reader maps the items file to memory and selects the blocks by time
+# using the index. It needs numpy while the writer does not.
+#
+# The long range queries are served by the rollup tiers kept along with the
+# series in the <name>.r<seconds> files. Every tier is the dense array of the
+# bucket records with items count, sum, min and max starting at the time given
+# in the header. The buckets are aligned to the tier period in UTC. The tiers
+# are updated on merge after the index records are written. The header keeps
+# the number of the index records rolled up so the tier missing some of them
+# is caught up on the next merge. The tier is marked dirty while being updated
+# and rebuilt from scratch if the update was interrupted.
+#
+
+import os, struct, mmap, time
+
+store_magic = b'PWS2'
+
+# magic, item period in seconds, scale
+idx_hdr = struct.Struct('<4sId')
+# first item timestamp, epoch, page sequence number, the first item index in the page, items count, items offset
+idx_rec = struct.Struct('<IHIHHI')
+
+item_fmt = '<%uH'
+item_sz  = 2
+
+# Rollup tier periods in seconds, every one is the multiple of the previous one.
+# The tiers not exceeding the item period are not kept.
+rollup_tiers = (60, 900, 3600, 86400)
+rollup_magic = b'PWR1'
+# magic, tier period, the first bucket start time, the number of the index records rolled up
+rollup_hdr = struct.Struct('<4sIII')
+# items count, sum, min, max
+rollup_rec = struct.Struct('<IQHH')
+rollup_dirty = 0xffffffff
+rollup_empty = (0, 0, 0xffff, 0)
+
+def rollup_items(items, tier):
+	b = {}
+	for t, v in items:
+		k = t - t % tier
+		r = b.get(k)
+		if r is None:
+			b[k] = [1, v, v, v]
+		else:
+			r[0] += 1
+			r[1] += v
+			if v < r[2]:
+				r[2] = v
+			if v > r[3]:
+				r[3] = v
+	return b
+
+def rollup_merge(r, s):
+	return [r[0] + s[0], r[1] + s[1], min(r[2], s[2]), max(r[3], s[3])]
+
+# Roll up the buckets of the finer tier
+def rollup_buckets(buckets, tier):
+	b = {}
+	for t, r in buckets.items():
+		k = t - t % tier
+		b[k] = rollup_merge(b[k], r) if k in b else r
+	return b
+
+class Rollup:
+	def __init__(self, path, tier):
+		self.path  = path
+		self.tier  = tier
+		self.t0    = 0
+		self.n     = 0
+		self.nrecs = 0
+		if os.path.exists(path):
+			with open(path, 'rb') as f:
+				hdr = f.read(rollup_hdr.size)
+			if len(hdr) == rollup_hdr.size:
+				magic, tier, t0, nrecs = rollup_hdr.unpack(hdr)
+				if magic == rollup_magic and tier == self.tier and nrecs != rollup_dirty:
+					self.t0, self.nrecs = t0, nrecs
+					self.n = (os.path.getsize(path) - rollup_hdr.size) // rollup_rec.size
+
+	def write_hdr(self, f, nrecs):
+		f.seek(0)
+		f.write(rollup_hdr.pack(rollup_magic, self.tier, self.t0, nrecs))
+		f.flush()
+
+	def read_recs(self, f, lo, hi):
+		f.seek(rollup_hdr.size + lo * rollup_rec.size)
+		d = f.read((hi - lo) * rollup_rec.size)
+		return [list(rollup_rec.unpack_from(d, i)) for i in range(0, len(d) - rollup_rec.size + 1, rollup_rec.size)]
+
+	# Add the buckets of the new items, nrecs is the number of the index records rolled up afterwards
+	def update(self, buckets, nrecs):
+		with open(self.path, 'r+b' if self.nrecs else 'w+b') as f:
+			if buckets:
+				first, last = min(buckets), max(buckets)
+				if not self.nrecs:
+					self.t0, self.n = first, 0
+				self.write_hdr(f, rollup_dirty)
+				recs = []
+				if first < self.t0:
+					# The buckets are shifted to make room for the earlier ones
+					recs = [list(rollup_empty) for i in range((self.t0 - first) // self.tier)] + self.read_recs(f, 0, self.n)
+					self.n += (self.t0 - first) // self.tier
+					self.t0 = first
+					lo, hi = 0, self.n
+				else:
+					lo = (first - self.t0) // self.tier
+					hi = min(self.n, (last - self.t0) // self.tier + 1)
+					if lo < hi:
+						recs = self.read_recs(f, lo, hi)
+					else:
+						lo = self.n
+				hi = (last - self.t0) // self.tier + 1
+				recs += [list(rollup_empty) for i in range(lo + len(recs), hi)]
+				for t, r in buckets.items():
+					i = (t - self.t0) // self.tier - lo
+					recs[i] = rollup_merge(recs[i], r)
+				f.seek(rollup_hdr.size + lo * rollup_rec.size)
+				f.write(b''.join([rollup_rec.pack(*r) for r in recs]))
+				self.n = max(self.n, hi)
+			self.write_hdr(f, nrecs)
+		self.nrecs = nrecs
+
+	# Returns bucket start times, item counts, scaled mean, min and max values
+	# of the non empty buckets ending after tmin as numpy arrays
+	def load(self, scale, tmin=None):
+		import numpy as np
+		dtype = np.dtype([('cnt', '<u4'), ('sum', '<u8'), ('min', '<u2'), ('max', '<u2')])
+		with open(self.path, 'rb') as f:
+			r = np.frombuffer(mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ), dtype=dtype, count=self.n, offset=rollup_hdr.size)
+		T = self.t0 + np.arange(self.n, dtype=np.int64) * self.tier
+		sel = r['cnt'] > 0
+		if tmin is not None:
+			sel &= T + self.tier > tmin
+		T, r = T[sel], r[sel]
+		return T, r['cnt'].astype(np.int64), r['sum'] * scale / r['cnt'], r['min'] * scale, r['max'] * scale
+
+class Series:
+	def __init__(self, path, name, period=None, scale=None):
+		self.val_path = os.path.join(path, name + '.val')
+		self.idx_path = os.path.join(path, name + '.idx')
+		if not os.path.exists(self.idx_path):
+			if period is None:
+				raise RuntimeError('%s not found' % self.idx_path)
+			if not os.path.isdir(path):
+				os.makedirs(path)
+			open(self.val_path, 'wb').close()
+			with open(self.idx_path, 'wb') as f:
+				f.write(idx_hdr.pack(store_magic, period, scale))
+		with open(self.idx_path, 'rb') as f:
+			magic, self.period, self.scale = idx_hdr.unpack(f.read(idx_hdr.size))
+			recs = f.read()
+		if magic != store_magic:
+			raise RuntimeError('%s is not the store index' % self.idx_path)
+		if period is not None and (period, scale) != (self.period, self.scale):
+			raise RuntimeError('%s period or scale mismatch' % self.idx_path)
+		# The incomplete record left by the interrupted merge is ignored
+		self.recs = [idx_rec.unpack_from(recs, i) for i in range(0, len(recs) - idx_rec.size + 1, idx_rec.size)]
+		self.end = max([r[5] + r[4] for r in self.recs] or [0])
+		# The number of items stored per (epoch, sn)
+		self.stored = {}
+		for t, e, sn, first, count, off in self.recs:
+			self.stored[(e, sn)] = max(self.stored.get((e, sn), 0), first + count)
+		base = os.path.join(path, name)
+		self.rollups = [Rollup(base + '.r%u' % tier, tier) for tier in rollup_tiers if tier > self.period]
+
+	def __len__(self):
+		return self.end
+
+	# The last page sequence number stored in the given epoch or -1
+	def last_sn(self, epoch):
+		return max([sn for e, sn in self.stored if e == epoch] or [-1])
+
+	# Append the items of the data pages not stored yet, returns the number of items added.
+	# The page item timestamps are ts + sn * sn_period + i * period where ts is the epoch start time.
+	def merge(self, epoch, ts, sn_period, pages):
+		recs = []
+		with open(self.val_path, 'r+b') as f:
+			f.seek(self.end * item_sz)
+			for p in sorted(pages, key=lambda p: p.sn):
+				first = self.stored.get((epoch, p.sn), 0)
+				count = len(p.data) - first
+				if count <= 0:
+					continue
+				f.write(struct.pack(item_fmt % count, *p.data[first:]))
+				recs.append((ts + p.sn * sn_period + first * self.period, epoch, p.sn, first, count, self.end))
+				self.stored[(epoch, p.sn)] = len(p.data)
+				self.end += count
+			# Drop the garbage left by the interrupted merge if any
+			f.truncate()
+		if recs:
+			with open(self.idx_path, 'r+b') as f:
+				f.seek(idx_hdr.size + len(self.recs) * idx_rec.size)
+				f.write(b''.join([idx_rec.pack(*r) for r in recs]))
+				f.truncate()
+			self.recs += recs
+		self.roll_up()
+		return sum([r[4] for r in recs])
+
+	# Returns (timestamp, raw value) of the items of the given index records
+	def items(self, recs):
+		with open(self.val_path, 'rb') as f:
+			for t, e, sn, first, count, off in recs:
+				f.seek(off * item_sz)
+				for i, v in enumerate(struct.unpack(item_fmt % count, f.read(count * item_sz))):
+					yield t + i * self.period, v
+
+	# Add the index records not rolled up yet to the tiers. The finer tier buckets
+	# are rolled up further for the coarser tiers behind by the same records.
+	def roll_up(self):
+		for nrecs in sorted(set([r.nrecs for r in self.rollups])):
+			if nrecs >= len(self.recs):
+				continue
+			buckets = None
+			for r in [r for r in self.rollups if r.nrecs == nrecs]:
+				if buckets is None:
+					buckets = rollup_items(self.items(self.recs[nrecs:]), r.tier)
+				else:
+					buckets = rollup_buckets(buckets, r.tier)
+				r.update(buckets, len(self.recs))
+
+	# The time span of the items measured after tmin in seconds
+	def span(self, tmin=None):
+		if not self.recs:
+			return 0
+		first = min([r[0] for r in self.recs])
+		last = max([r[0] + (r[4] - 1) * self.period for r in self.recs])
+		return max(last - max(first, tmin or 0), 0)
+
+	# Returns timestamps, item counts, mean, min and max values of the coarsest
+	# rollup tier not exceeding the resolution in seconds. The items are returned
+	# as they are if there is no such tier or it is not up to date.
+	def rollup(self, tmin=None, resolution=0):
+		import numpy as np
+		tiers = [r for r in self.rollups if r.tier <= resolution and r.nrecs == len(self.recs)]
+		if not tiers:
+			T, Y = self.load(tmin)
+			return T, np.ones(len(T), dtype=np.int64), Y, Y, Y
+		return tiers[-1].load(self.scale, tmin)
+
+	# Returns timestamps and scaled values of the items measured after tmin as numpy arrays
+	def load(self, tmin=None):
+		import numpy as np
+		idx = np.array(self.recs, dtype=[
+			('t', np.int64), ('epoch', np.int64), ('sn', np.int64), ('first', np.int64), ('count', np.int64), ('off', np.int64)
+		])
+		# The blocks are appended in time order as a rule, make sure anyway
+		idx = idx[np.argsort(idx['t'], kind='mergesort')]
+		if tmin is not None:
+			# The block started before tmin may have items after it as well
+			idx = idx[max(np.searchsorted(idx['t'], tmin, 'right') - 1, 0):]
+		if not self.end or not len(idx):
+			return np.zeros(0, dtype=np.int64), np.zeros(0)
+		with open(self.val_path, 'rb') as f:
+			val = np.frombuffer(mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ), dtype='<u2', count=self.end)
+		cnt = idx['count']
+		pos = np.arange(cnt.sum()) - np.repeat(np.cumsum(cnt) - cnt, cnt)
+		T = np.repeat(idx['t'], cnt) + pos * self.period
+		Y = val[np.repeat(idx['off'], cnt) + pos] * self.scale
+		if tmin is not None:
+			sel = T > tmin
+			T, Y = T[sel], Y[sel]
+		return T, Y
+
+# The start time computed by the host from the transmitter uptime varies by
+# the query latency and the transmitter clock drift, the latter is below
+# 50 ppm or 2 minutes per month. So the tolerance grows with the uptime at
+# twice the drift rate. The epoch start time is kept fixed so the stored
+# timestamps do not jitter between downloads. It is refreshed only once the
+# drift exceeds start_time_refresh so the timestamps error stays bounded.
+start_time_tolerance = 120
+start_time_drift     = 100e-6
+start_time_refresh   = 30
+
+class Store:
+	def __init__(self, path):
+		self.path = path
+		self.epochs_path = os.path.join(path, 'epochs')
+		self.epochs = []
+		if os.path.exists(self.epochs_path):
+			with open(self.epochs_path) as f:
+				self.epochs = [int(l) for l in f if l.strip()]
+
+	def series(self, name, period=None, scale=None):
+		return Series(self.path, name, period, scale)
+
+	# Returns the index and the start time of the epoch the pages downloaded from
+	# the transmitter started at ts belong to. The domains is the list of
+	# (series, pages) tuples. The transmitter is rebooted since the previous
+	# download if its start time has changed or the sequence numbers went back.
+	# Then the new epoch is started.
+	def epoch(self, ts, domains):
+		if self.epochs:
+			e = len(self.epochs) - 1
+			tolerance = max(start_time_tolerance, (time.time() - ts) * start_time_drift)
+			rebooted = abs(ts - self.epochs[e]) > tolerance
+			for s, pages in domains:
+				if pages and max([p.sn for p in pages]) < s.last_sn(e):
+					rebooted = True
+			if not any([pages for s, pages in domains]):
+				return e, self.epochs[e]
+			if not rebooted:
+				if abs(ts - self.epochs[e]) > start_time_refresh:
+					self.update_epoch(e, ts)
+				return e, self.epochs[e]
+		self.epochs.append(ts)
+		self.write_epochs()
+		return len(self.epochs) - 1, ts
+
+	def update_epoch(self, e, ts):
+		if self.epochs[e] != ts:
+			self.epochs[e] = ts
+			self.write_epochs()
+
+	# The file is replaced at once so it is never left truncated
+	def write_epochs(self):
+		if not os.path.isdir(self.path):
+			os.makedirs(self.path)
+		tmp = self.epochs_path + '.tmp'
+		with open(tmp, 'w') as f:
+			f.write(''.join(['%u\n' % t for t in self.epochs]))
+		if os.path.exists(self.epochs_path):
+			os.remove(self.epochs_path)
+		os.rename(tmp, self.epochs_path)
+
+	def add_meter_reading(self, t, epoch, wh):
+		with open(os.path.join(self.path, 'energy'), 'a') as f:
+			f.write('%u %u %u\n' % (t, epoch, wh))
+
+	# Returns the list of (time, epoch, Wh) tuples
+	def meter_readings(self):
+		path = os.path.join(self.path, 'energy')
+		if not os.path.exists(path):
+			return []
+		with open(path) as f:
+			return [tuple(map(int, l.split())) for l in f if len(l.split()) == 3]
+
+def is_series(file):
+	return os.path.exists(file + '.idx')
+
+# Open the series given by the store directory and name like pwdata/pw
+def open_series(file):
+	return Series(os.path.dirname(file) or '.', os.path.basename(file))
+
+def load(file, tmin=None):
+	return open_series(file).load(tmin)
@@ -1,7 +1,98 @@
 #include "crc32.h"
 
+/*
+ * The engine is selected at build time:
+ *  CRC32_NIBBLE - 4 bits per step with 64 bytes table, for the targets short of flash
+ *  CRC32_SLICE8 - 8 bytes per step with 8 KB table built on the first call, for host tools
+ *  otherwise    - 4 bytes per step with precalculated 4 KB table
+ * All of them give the same results, see src/sim/crc_bench.c for the throughput.
+ */
+
+#if defined(CRC32_NIBBLE)
+
+static const uint32_t crc32_table[16] =
+{
+	0x00000000, 0x105ec76f, 0x20bd8ede, 0x30e349b1, 0x417b1dbc, 0x5125dad3, 0x61c69362, 0x7198540d,
+	0x82f63b78, 0x92a8fc17, 0xa24bb5a6, 0xb21572c9, 0xc38d26c4, 0xd3d3e1ab, 0xe330a81a, 0xf36e6f75
+};
+
+uint32_t crc32up(uint32_t crc, uint8_t const *s, unsigned len)
+{
+	crc ^= 0xFFFFFFFF;
+
+	while (len) {
+		crc ^= *s;
+		crc = crc32_table[crc & 15] ^ (crc >> 4);
+		crc = crc32_table[crc & 15] ^ (crc >> 4);
+		s++;
+		len--;
+	}
+
+	return crc ^ 0xFFFFFFFF;
+}
+
+#elif defined(CRC32_SLICE8)
+
+#define CRC32_POLY 0x82F63B78
+
+static uint32_t crc32_table[8][256];
+
+static void crc32_init(void)
+{
+	unsigned i, j;
+	for (i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (j = 0; j < 8; j++)
+			c = (c & 1) ? (c >> 1) ^ CRC32_POLY : c >> 1;
+		crc32_table[0][i] = c;
+	}
+	/* table[j] accounts the byte followed by j zero bytes */
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			crc32_table[j][i] = (crc32_table[j-1][i] >> 8) ^ crc32_table[0][crc32_table[j-1][i] & 255];
+}
+
+/* not optimized for BE architecture */
+uint32_t crc32up(uint32_t crc, uint8_t const *s, unsigned len)
+{
+	if (!crc32_table[0][1])
+		crc32_init();
+
+	crc ^= 0xFFFFFFFF;
+
+	while (((unsigned long)s & 7) && len) {
+		crc = crc32_table[0][(unsigned char)(crc ^ (*s))] ^ (crc >> 8);
+		s++;
+		len--;
+	}
+	while (len >= 8) {
+		const uint32_t *w = (const uint32_t *)s;
+		uint32_t hi = w[1];
+		crc ^= w[0];
+		crc =   crc32_table[7][(crc) & 255] ^
+			crc32_table[6][(crc >> 8) & 255] ^
+			crc32_table[5][(crc >> 16) & 255] ^
+			crc32_table[4][(crc >> 24) & 255] ^
+			crc32_table[3][(hi) & 255] ^
+			crc32_table[2][(hi >> 8) & 255] ^
+			crc32_table[1][(hi >> 16) & 255] ^
+			crc32_table[0][(hi >> 24) & 255];
+		s += 8;
+		len -= 8;
+	}
+	while (len) {
+		crc = crc32_table[0][(unsigned char)(crc ^ (*s))] ^ (crc >> 8);
+		s++;
+		len--;
+	}
+
+	return crc ^ 0xFFFFFFFF;
+}
+
+#else
+
 /* precalculated for 32bit / LE case */
-static uint32_t crc32_table[4][256] =
+static const uint32_t crc32_table[4][256] =
 {{
 	0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4, 0xc79a971f, 0x35f1141c, 0x26a1e7e8, 0xd4ca64eb, 0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b,
 	0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24, 0x105ec76f, 0xe235446c, 0xf165b798, 0x030e349b, 0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
@@ -124,3 +215,5 @@ uint32_t crc32up(uint32_t crc, uint8_t const *s, unsigned len)
 
 	return crc ^ 0xFFFFFFFF;
 }
+
+#endif
@@ -2,6 +2,7 @@
 #include "ble_flash.h"
 #include "bmap.h"
 #include "bug.h"
+#include "crc32.h"
 
 #include <stddef.h>
 
@@ -9,6 +10,7 @@
 
 BUILD_BUG_ON(sizeof(struct data_page) != DATA_PAGE_SZ);
 BUILD_BUG_ON(sizeof(union data_page_fragmented) != DATA_PAGE_SZ);
+BUILD_BUG_ON(DATA_DOMAINS_INVALID);
 
 static inline unsigned data_log_pg_index(struct data_log const* dl, struct data_page const* pg)
 {
@@ -53,11 +55,24 @@ static inline void data_log_pg_mark_fragment_used(struct data_page const* pg, in
     BUG_ON(bmap_get_bit(&pg->h.unused_fragments, fragment));
 }
 
+uint32_t data_log_pg_crc(struct data_log const* dl, struct data_page const* pg)
+{
+    if (pg != dl->last_pg) {
+        return pg->crc;
+    }
+    // Account the erased part of the last page
+    return crc32up(dl->crc, pg->ibytes + dl->next_item * sizeof(uint32_t),
+        (DATA_PAGE_ITEMS - dl->next_item) * sizeof(uint32_t));
+}
+
 void data_log_put_item(struct data_log* dl, uint32_t item, uint32_t sn)
 {
     int fragment = 0;
     if (!dl->next_item || dl->next_item >= DATA_PAGE_ITEMS || dl->suspended)
     {
+        if (dl->last_pg) {
+            ble_flash_word_write((uint32_t*)&dl->last_pg->crc, data_log_pg_crc(dl, dl->last_pg));
+        }
         if (!dl->last_pg) {
             BUG_ON(dl->next_item);
             dl->first_pg = dl->last_pg = data_log_pg(dl, dl->param->pfirst);
@@ -69,10 +84,12 @@ void data_log_put_item(struct data_log* dl, uint32_t item, uint32_t sn)
         }
         dl->next_item = 0;
         dl->suspended = 0;
+        dl->crc = 0;
         data_log_pg_init(dl, dl->last_pg, sn);
         bmap_set_bit(dl->param->pmap, data_log_pg_index(dl, dl->last_pg));
     }
     ble_flash_word_write((uint32_t*)&dl->last_pg->items[dl->next_item], item);
+    dl->crc = crc32up(dl->crc, (uint8_t const*)&item, sizeof(item));
     ++dl->next_item;
     fragment = (OFFSETOF(struct data_page, items[dl->next_item]) + DATA_FRAG_SZ - 1) / DATA_FRAG_SZ - 1;
     if (bmap_get_bit(&dl->last_pg->h.unused_fragments, fragment)) {
@@ -94,4 +111,5 @@ void data_log_initialize(
     dl->last_pg = 0;
     dl->next_item = 0;
     dl->suspended = 0;
+    dl->crc = 0;
 }
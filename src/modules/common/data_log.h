@@ -16,6 +16,7 @@ struct data_log {
     struct data_page const*      last_pg;
     unsigned short               next_item;
     unsigned short               suspended;
+    uint32_t                     crc; // CRC32 of the items written to the last page
 };
 
 
@@ -26,6 +27,25 @@ void data_log_initialize(
 
 void data_log_put_item(struct data_log* dl, uint32_t item, uint32_t sn);
 
+// Returns the page CRC. It is stored in the page once it is completed.
+uint32_t data_log_pg_crc(struct data_log const* dl, struct data_page const* pg);
+
+// Returns non zero if the page belongs to the log
+static inline int data_log_owns_pg(struct data_log const* dl, struct data_page const* pg)
+{
+    unsigned idx = pg - (struct data_page const*)dl->param->buff;
+    return idx - dl->param->pfirst < dl->param->npages;
+}
+
+// Returns the number of items that may be put to the current page, 0 if the next one starts the new page
+static inline unsigned data_log_room(struct data_log const* dl)
+{
+    if (!dl->last_pg || dl->suspended) {
+        return 0;
+    }
+    return DATA_PAGE_ITEMS - dl->next_item;
+}
+
 static inline void data_log_suspend(struct data_log* dl)
 {
     dl->suspended = 1;
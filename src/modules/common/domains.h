@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The data domains description. The domain identifiers, the pages layout,
+// the history parameters and the host decoder tables are all derived from it.
+// Run host/gen_domains.py after changing it to update the host tables.
+//
+// Every domain is described as DOMAIN(id, name, pages, period, input, values, scale)
+//  id     - the identifier, data_domain_t value is dom_<id>
+//  name   - the host series name
+//  pages  - the number of data pages, the pages are allocated in the order given
+//  period - the item bucket period in seconds
+//  input  - the domain feeding this one by its completed buckets or the own id
+//           if it is fed by samples, the domain may feed the single other one
+//  values - the 16 bit values per bucket, 1 for the mean, 3 for the mean, min and max
+//  scale  - the value units for the host
+#define DATA_DOMAINS(DOMAIN) \
+    DOMAIN(fast_pw, pw,         200, FAST_PW_PERIOD, fast_pw, 1, .2    ) /* ~ 2 weeks */   \
+    DOMAIN(slow_pw, pw_history, 20,  SLOW_PW_PERIOD, fast_pw, 3, .2    ) /* ~ 3.5 months */ \
+    DOMAIN(vbatt,   vbatt,      4,   VBATT_PERIOD,   vbatt,   1, .0001 ) /* ~ 2 weeks */
+
+#define DOMAIN_ID_(id, name, pages, period, input, values, scale) dom_##id,
+
+// Data domain identifiers
+typedef enum {
+    DATA_DOMAINS(DOMAIN_ID_)
+    dom_count,
+} data_domain_t;
+
+#define DOMAIN_PARAMS_(id, name, pages, period, input, values, scale) \
+    dom_##id##_period = (period), \
+    dom_##id##_input  = dom_##input, \
+    dom_##id##_values = (values),
+
+enum {
+    DATA_DOMAINS(DOMAIN_PARAMS_)
+};
+
+#define DOM_PERIOD(id) dom_##id##_period
+#define DOM_VALUES(id) dom_##id##_values
+#define DOM_INPUT(id)  dom_##id##_input
+
+// The domain pages follow each other so the first page index is the field
+// offset in the structure with the pages counters of every domain.
+#define DOMAIN_PAGES_(id, name, pages, period, input, values, scale) uint8_t id[pages];
+
+struct data_pages_layout {
+    DATA_DOMAINS(DOMAIN_PAGES_)
+};
+
+#define DOM_PFIRST(id) offsetof(struct data_pages_layout, id)
+#define DOM_PAGES(id)  sizeof(((struct data_pages_layout*)0)->id)
+
+#define DATA_PAGES sizeof(struct data_pages_layout)
+
+// The domain value units
+#define DOMAIN_SCALE_(id, name, pages, period, input, values, scale) \
+    case dom_##id: return (scale);
+
+static inline float dom_scale(data_domain_t d)
+{
+    switch (d) {
+    DATA_DOMAINS(DOMAIN_SCALE_)
+    default: return 0;
+    }
+}
+
+// The period of the domain input, either the samples or the feeding domain buckets
+#define DOMAIN_INPUT_PERIOD_(id, name, pages, period, input, values, scale) \
+    dom_##id##_input_period = dom_##input == dom_##id ? MEASURING_PERIOD : dom_##input##_period,
+
+enum {
+    DATA_DOMAINS(DOMAIN_INPUT_PERIOD_)
+};
+
+#define DOM_INPUT_PERIOD(id) dom_##id##_input_period
+
+// Non zero if the description is inconsistent, checked by BUILD_BUG_ON(DATA_DOMAINS_INVALID).
+// The page index is 8 bit, the feeding domain should precede the one it feeds.
+#define DOMAIN_INVALID_(id, name, pages, period, input, values, scale) \
+    || (period) % dom_##id##_input_period \
+    || ((values) != 1 && (values) != 3) \
+    || dom_##input > dom_##id
+
+#define DATA_DOMAINS_INVALID (DATA_PAGES > 256 DATA_DOMAINS(DOMAIN_INVALID_))
@@ -10,24 +10,63 @@ static inline void data_hist_reset(struct data_history* h)
 void data_hist_initialize(struct data_history* h, struct data_history_param const* param)
 {
     h->param = param;
+    h->next = 0;
     data_log_initialize(&h->storage, &param->storage);
     data_hist_reset(h);
 }
 
-void data_hist_put_sample(struct data_history* h, uint16_t sample, uint32_t sn)
+static void data_hist_put_min_max(struct data_history* h)
 {
+    data_hist_item_t item = {.data = {h->samples_max, (uint16_t)~0}};
+    h->item_buff.data[1] = h->samples_min;
+    if (data_log_room(&h->storage) == 1) {
+        // Leave the last item erased so the page starts with the bucket
+        data_log_suspend(&h->storage);
+    }
+    data_log_put_item(&h->storage, h->item_buff.item, h->item_sn);
+    data_log_put_item(&h->storage, item.item, h->item_sn);
+    h->data_idx = -1;
+}
+
+// The bucket completed is passed to the next history so the input is the mean,
+// min and max of the finer history bucket or the sample itself
+static void data_hist_put(struct data_history* h, uint16_t val, uint16_t min, uint16_t max, uint32_t sn)
+{
+    uint16_t mean;
     if (h->data_idx < 0)
     {
         h->data_idx = 0;
         h->item_sn = sn;
     }
-    h->samples_sum += sample;
+    if (!h->samples_cnt)
+    {
+        h->bucket_sn = sn;
+        h->samples_min = min;
+        h->samples_max = max;
+    }
+    else
+    {
+        if (min < h->samples_min)
+            h->samples_min = min;
+        if (max > h->samples_max)
+            h->samples_max = max;
+    }
+    h->samples_sum += val;
     if (++h->samples_cnt >= h->param->item_samples)
     {
-        h->item_buff.data[h->data_idx] = h->samples_sum / h->samples_cnt;
+        mean = h->samples_sum / h->samples_cnt;
+        h->item_buff.data[h->data_idx] = mean;
         h->samples_sum = 0;
         h->samples_cnt = 0;
-        if (++h->data_idx >= 2)
+        if (h->next)
+        {
+            data_hist_put(h->next, mean, h->samples_min, h->samples_max, h->bucket_sn);
+        }
+        if (h->param->min_max)
+        {
+            data_hist_put_min_max(h);
+        }
+        else if (++h->data_idx >= 2)
         {
             data_log_put_item(&h->storage, h->item_buff.item, h->item_sn);
             h->data_idx = -1;
@@ -35,6 +74,11 @@ void data_hist_put_sample(struct data_history* h, uint16_t sample, uint32_t sn)
     }
 }
 
+void data_hist_put_sample(struct data_history* h, uint16_t sample, uint32_t sn)
+{
+    data_hist_put(h, sample, sample, sample, sn);
+}
+
 void data_hist_suspend(struct data_history* h)
 {
     data_log_suspend(&h->storage);
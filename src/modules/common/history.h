@@ -9,17 +9,27 @@ typedef union data_hist_item {
 
 struct data_history_param {
     struct data_log_param  storage;
+    // The number of inputs per bucket. The input is either the sample or the
+    // bucket completed by the finer history feeding this one.
     unsigned               item_samples;
+    // Store the samples min and max along with the mean. The bucket takes two items
+    // then: mean, min, max and the erased value, it is never split between pages.
+    // Otherwise every item keeps the mean values of two buckets.
+    int                    min_max;
 };
 
 struct data_history {
     struct data_log                  storage;
     struct data_history_param const* param;
+    struct data_history*             next; // the coarser history fed by the buckets completed by this one if any
     data_hist_item_t                 item_buff;
     uint32_t                         item_sn;
+    uint32_t                         bucket_sn;
     int                              data_idx;
     uint32_t                         samples_sum;
     unsigned                         samples_cnt;
+    uint16_t                         samples_min;
+    uint16_t                         samples_max;
 };
 
 void data_hist_initialize(struct data_history* h, struct data_history_param const* param);
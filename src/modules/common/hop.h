@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+
+//
+// Data transfer channel hopping.
+// The reports are always sent on PROTOCOL_CHANNEL. Every data request carries the channel
+// to be used for the following data burst and the subsequent report / data request exchange.
+// The receiver chooses the channel following the hop schedule below and skipping channels
+// with high loss rate. If the data request is lost the transmitter repeats the report on
+// the current channel and then on PROTOCOL_CHANNEL where the receiver returns as soon as
+// it does not hear the data burst on the new channel.
+//
+
+// Channels used for data transfer. They are placed in between Wi-Fi channels 1, 6, 11
+// and avoid BLE advertising channels.
+#define HOP_CHANNELS 8
+#define HOP_STRIDE   3 // must be coprime with HOP_CHANNELS
+
+static const uint8_t g_hop_channels[HOP_CHANNELS] = {24, 25, 48, 49, 50, 74, 76, 78};
+
+// Returns the index of the n-th channel in the hop schedule following the report with sequence number sn
+static inline unsigned hop_index(uint32_t sn, unsigned n)
+{
+    return (sn + n * HOP_STRIDE) % HOP_CHANNELS;
+}
@@ -0,0 +1,207 @@
+#include "page_cache.h"
+#include "ble_flash.h"
+#include "crc32.h"
+#include "bug.h"
+#include "bmap.h"
+
+#include <string.h>
+
+// The slot is free if its header is erased. The header is written after the
+// page content so the slot interrupted by reset is either free or fails CRC
+// check on startup. The free slot may still keep the content written before
+// the reset so it is erased unless blank before writing.
+#pragma data_alignment=DATA_PAGE_SZ
+static const struct data_page g_cache_pages[PAGE_CACHE_PAGES];
+
+// The next slot to be reused when there are no free ones
+static unsigned g_cache_next;
+
+// The slots written in the current pass
+static uint8_t g_cache_pass[(PAGE_CACHE_PAGES+7)/8];
+
+// The transmitters boot identities, valid if the bit is set in g_cache_boot_set.
+// The pages are matched by any identity till it is set.
+static uint32_t g_cache_boot[MAX_DEVICES];
+static uint8_t  g_cache_boot_set[(MAX_DEVICES+7)/8];
+
+static inline int page_cache_free(struct data_page const* pg)
+{
+    return !~pg->h.sn && pg->h.fragment_ == 0xff;
+}
+
+static int page_cache_blank(struct data_page const* pg)
+{
+    uint32_t const* w = (uint32_t const*)pg;
+    unsigned i;
+    for (i = 0; i < DATA_PAGE_SZ / sizeof(uint32_t); ++i) {
+        if (~w[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static inline int page_cache_valid(struct data_page const* pg)
+{
+    return  pg->h.fragment_ < MAX_DEVICES &&
+            pg->h.page_idx < DATA_PAGES &&
+            pg->crc == crc32(pg->ibytes, sizeof(pg->ibytes));
+}
+
+static inline void page_cache_erase(struct data_page const* pg)
+{
+    ble_flash_page_erase((unsigned)pg / DATA_PAGE_SZ);
+}
+
+void page_cache_init(void)
+{
+    unsigned i;
+    for (i = 0; i < PAGE_CACHE_PAGES; ++i) {
+        struct data_page const* pg = &g_cache_pages[i];
+        if (!page_cache_free(pg) && !page_cache_valid(pg)) {
+            page_cache_erase(pg);
+        }
+    }
+}
+
+static inline int page_cache_boot_valid(unsigned dev_id, uint32_t boot)
+{
+    return !bmap_get_bit(g_cache_boot_set, dev_id) || g_cache_boot[dev_id] == boot;
+}
+
+void page_cache_set_boot(unsigned dev_id, uint32_t boot, uint32_t sn)
+{
+    unsigned i;
+    int known = bmap_get_bit(g_cache_boot_set, dev_id);
+    BUG_ON(dev_id >= MAX_DEVICES);
+    if (known && g_cache_boot[dev_id] == boot) {
+        return;
+    }
+    for (i = 0; i < PAGE_CACHE_PAGES; ++i) {
+        struct data_page const* pg = &g_cache_pages[i];
+        if (pg->h.fragment_ == dev_id && (known || pg->h.sn > sn)) {
+            page_cache_erase(pg);
+        }
+    }
+    g_cache_boot[dev_id] = boot;
+    bmap_set_bit(g_cache_boot_set, dev_id);
+}
+
+struct data_page const* page_cache_find(unsigned dev_id, uint32_t boot, unsigned page_idx, uint32_t sn)
+{
+    unsigned i;
+    if (!page_cache_boot_valid(dev_id, boot)) {
+        return 0;
+    }
+    for (i = 0; i < PAGE_CACHE_PAGES; ++i) {
+        struct data_page const* pg = &g_cache_pages[i];
+        if (pg->h.fragment_ == dev_id && pg->h.page_idx == page_idx && pg->h.sn == sn) {
+            return pg;
+        }
+    }
+    return 0;
+}
+
+struct data_page const* page_cache_next(unsigned dev_id, unsigned* slot)
+{
+    for (; *slot < PAGE_CACHE_PAGES; ++*slot) {
+        struct data_page const* pg = &g_cache_pages[*slot];
+        if (pg->h.fragment_ == dev_id) {
+            ++*slot;
+            return pg;
+        }
+    }
+    return 0;
+}
+
+unsigned page_cache_count(unsigned dev_id)
+{
+    unsigned slot = 0, cnt = 0;
+    while (page_cache_next(dev_id, &slot)) {
+        ++cnt;
+    }
+    return cnt;
+}
+
+int page_cache_is_new(unsigned dev_id, uint32_t boot, struct data_page_hdr const* hdr)
+{
+    unsigned i;
+    if (!page_cache_boot_valid(dev_id, boot)) {
+        return 0;
+    }
+    for (i = 0; i < PAGE_CACHE_PAGES; ++i) {
+        struct data_page const* pg = &g_cache_pages[i];
+        if (pg->h.fragment_ == dev_id && pg->h.domain == hdr->domain && pg->h.sn >= hdr->sn) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void page_cache_new_pass(void)
+{
+    memset(g_cache_pass, 0, sizeof(g_cache_pass));
+}
+
+// Choose the slot for the new page. The outdated copy of the same page is
+// replaced first, then the free slot is taken. Otherwise the slots not written
+// in the current pass are reused in round robin order. Returns 0 if there are
+// no such slots.
+static struct data_page const* page_cache_slot(unsigned dev_id, unsigned page_idx)
+{
+    unsigned i, n;
+    struct data_page const* free_pg = 0;
+    for (i = 0; i < PAGE_CACHE_PAGES; ++i) {
+        struct data_page const* pg = &g_cache_pages[i];
+        if (pg->h.fragment_ == dev_id && pg->h.page_idx == page_idx) {
+            return pg;
+        }
+        if (!free_pg && page_cache_free(pg)) {
+            free_pg = pg;
+        }
+    }
+    if (free_pg) {
+        return free_pg;
+    }
+    for (n = 0; n < PAGE_CACHE_PAGES; ++n) {
+        i = g_cache_next;
+        g_cache_next = (i + 1) % PAGE_CACHE_PAGES;
+        if (!bmap_get_bit(g_cache_pass, i)) {
+            return &g_cache_pages[i];
+        }
+    }
+    return 0;
+}
+
+void page_cache_put(unsigned dev_id, uint32_t boot, struct data_page_hdr const* hdr, void const* const fragments[DATA_PG_FRAGMENTS], uint32_t crc)
+{
+    struct data_page const* slot;
+    struct data_page_hdr h = *hdr;
+    unsigned f;
+    BUG_ON(dev_id >= MAX_DEVICES || h.page_idx >= DATA_PAGES);
+    if (!page_cache_boot_valid(dev_id, boot)) {
+        return;
+    }
+    slot = page_cache_find(dev_id, boot, h.page_idx, h.sn);
+    if (slot && slot->crc == crc) {
+        // Already there, the flash is not worn by rewriting it
+        bmap_set_bit(g_cache_pass, slot - g_cache_pages);
+        return;
+    }
+    if (!(slot = page_cache_slot(dev_id, h.page_idx))) {
+        return;
+    }
+    bmap_set_bit(g_cache_pass, slot - g_cache_pages);
+    if (!page_cache_blank(slot)) {
+        page_cache_erase(slot);
+    }
+    for (f = 0; f < DATA_PG_FRAGMENTS; ++f) {
+        unsigned off = f ? 0 : DATA_PAGE_HDR_SZ;
+        unsigned end = f < DATA_PG_FRAGMENTS - 1 ? DATA_FRAG_SZ : DATA_FRAG_SZ - DATA_PAGE_CRC_SZ;
+        ble_flash_block_write((uint32_t*)((uint8_t const*)slot + f * DATA_FRAG_SZ + off),
+                              (uint32_t*)((uint8_t const*)fragments[f] + off), (end - off) / sizeof(uint32_t));
+    }
+    ble_flash_word_write((uint32_t*)&slot->crc, crc);
+    h.fragment_ = dev_id;
+    ble_flash_block_write((uint32_t*)&slot->h, (uint32_t*)&h, DATA_PAGE_HDR_SZ / sizeof(uint32_t));
+}
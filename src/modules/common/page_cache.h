@@ -0,0 +1,52 @@
+#pragma once
+
+#include "proto.h"
+
+// The data pages downloaded from transmitters are mirrored to the receiver
+// flash so they may be served to the host later without the radio. The pages
+// are keyed by transmitter id, page index and sequence number. Only one copy
+// of the page with given index is kept per transmitter since the transmitter
+// overwrites the page with the same index as well.
+//
+// The transmitter restart resets the sequence numbers so the pages cached
+// before it would be taken for the new ones. The pages are matched against the
+// transmitter boot identity given by page_cache_set_boot(). It is not stored in
+// flash so the pages found on the receiver startup are matched by any identity
+// till the first one is set. They are kept unless their sequence numbers are
+// ahead of the transmitter.
+
+#ifndef PAGE_CACHE_PAGES
+#define PAGE_CACHE_PAGES 64
+#endif
+
+// Validate the cached pages, the invalid ones are erased
+void page_cache_init(void);
+
+// Set the transmitter boot identity on its restart and on the first report
+// received. The pages cached for the other boot are dropped. The sn is the
+// transmitter's current sequence number.
+void page_cache_set_boot(unsigned dev_id, uint32_t boot, uint32_t sn);
+
+// Returns cached page or 0 if not found
+struct data_page const* page_cache_find(unsigned dev_id, uint32_t boot, unsigned page_idx, uint32_t sn);
+
+// Iterate over the pages cached for the transmitter. The slot should be zero on
+// the first call. Returns 0 when there are no more pages.
+struct data_page const* page_cache_next(unsigned dev_id, unsigned* slot);
+
+// Returns non zero if the page is newer than every page of the same domain
+// cached for the transmitter so it is worth caching
+int page_cache_is_new(unsigned dev_id, uint32_t boot, struct data_page_hdr const* hdr);
+
+// Start the new caching pass. The pages stored in the current pass are not
+// evicted by the other ones, the page is dropped if there is no room for it.
+void page_cache_new_pass(void);
+
+// Store the page verified by CRC given by its header, fragments and CRC. The
+// header stored in the first fragment is ignored. The header fragment_ field is
+// replaced by transmitter id. The page is not stored if the boot identity is
+// outdated.
+void page_cache_put(unsigned dev_id, uint32_t boot, struct data_page_hdr const* hdr, void const* const fragments[DATA_PG_FRAGMENTS], uint32_t crc);
+
+// Returns the number of pages cached for the transmitter
+unsigned page_cache_count(unsigned dev_id);
@@ -1,13 +1,16 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
-#define PROTOCOL_VERSION 1
+#define PROTOCOL_VERSION 7
 #define PROTOCOL_MAGIC   0x766f7661
 #define PROTOCOL_CHANNEL 0
+#define MAX_CHANNEL      80 // 2480 MHz
 
 // System status flags
 #define STATUS_NEW_SAMPLE 1   // new sample acquired
+#define STATUS_LAYOUT     2   // layout packet follows the report
 #define STATUS_CHARGED   0x10 // Vbatt >= 4.1V, charging stopped
 #define STATUS_LOW_BATT  0x20 // Vbatt <= 3.4V, connection mode disabled
 #define STATUS_SILENT    0x40 // Vbatt <= 3.3V, reports transmitting stopped
@@ -28,24 +31,16 @@
 #define VBATT_PERIOD     2
 #endif
 
-// Data domain identifiers
-typedef enum {
-    dom_fast_pw = 0,
-    dom_slow_pw,
-    dom_vbatt,
-    dom_count,
-} data_domain_t;
+// Data domains and their pages, see domains.h. Every item keeps two 16 bit mean
+// values of the domain with one value per bucket, otherwise the bucket takes two
+// items: the mean, min, max and the erased value.
+#include "domains.h"
 
 #define DATA_PG_FRAGMENTS 8
 #define DATA_PAGE_SZ 1024
 #define DATA_FRAG_SZ (DATA_PAGE_SZ/DATA_PG_FRAGMENTS)
 
-#define FAST_PW_PAGES 200 // ~ 2 weeks
-#define SLOW_PW_PAGES 20  // ~ 1 year
-#define VBATT_PAGES   4   // ~ 2 weeks
-
-#define DATA_PAGES (FAST_PW_PAGES+SLOW_PW_PAGES+VBATT_PAGES)
-#define DATA_PG_BITMAP_SZ   (DATA_PAGES/8) // 28  bytes to store bits per every page
+#define DATA_PG_BITMAP_SZ ((DATA_PAGES+7)/8) // bytes to store bits per every page
 
 // Data page header
 struct data_page_hdr {
@@ -57,7 +52,8 @@ struct data_page_hdr {
 };
 
 #define DATA_PAGE_HDR_SZ sizeof(struct data_page_hdr)
-#define DATA_PAGE_ITEMS ((DATA_PAGE_SZ-DATA_PAGE_HDR_SZ)/4)
+#define DATA_PAGE_CRC_SZ sizeof(uint32_t)
+#define DATA_PAGE_ITEMS ((DATA_PAGE_SZ-DATA_PAGE_HDR_SZ-DATA_PAGE_CRC_SZ)/4)
 
 // Data page
 struct data_page {
@@ -67,6 +63,7 @@ struct data_page {
         uint16_t ishort[2*DATA_PAGE_ITEMS];
         uint8_t  ibytes[4*DATA_PAGE_ITEMS];
     };
+    uint32_t crc; // CRC32 of the items, the ones not written yet are counted as erased
 };
 
 // Data page split onto fragments
@@ -80,14 +77,20 @@ typedef enum {
 	packet_report,
 	packet_data_req,
 	packet_data,
+	packet_layout,
 } packet_type_t;
 
+// Transmitter identifiers are in the range 0..MAX_DEVICES-1
+#define MAX_DEVICES 32
+
 // Common packet header
 struct packet_hdr {
     uint8_t  sz;
 	uint8_t  version;
 	uint8_t  type;
 	uint8_t  status;
+	uint8_t  dev_id;   // transmitter identifier
+	uint8_t  reserved[3];
 	uint32_t magic;
 };
 
@@ -97,6 +100,7 @@ struct report_packet {
 	uint32_t          sn;
 	uint16_t          power;
 	uint16_t          vbatt;
+	uint32_t          energy; // Wh consumed since the transmitter start
 	uint8_t           page_bitmap[DATA_PG_BITMAP_SZ];
 };
 
@@ -104,11 +108,46 @@ struct report_packet {
 struct data_req_packet {
 	struct packet_hdr hdr;
 	uint8_t           fragment_bitmap[DATA_PAGES];
+	uint8_t           chan; // channel for the data transmission
 };
 
 // Required fragments bitmap from the client
 struct data_packet {
 	struct packet_hdr    hdr;
 	struct data_page_hdr pg_hdr;
+	uint32_t             pg_crc; // the page CRC at the time of sending
 	uint8_t              fragment[DATA_FRAG_SZ];
 };
+
+// Protocol features advertised in the layout packet
+#define FEATURE_ENERGY  1 // the report carries the energy counter
+#define FEATURE_MIN_MAX 2 // the domain bucket may keep the min and max values
+#define FEATURE_LAYOUT_CRC 4 // the layout packet carries CRC32
+
+// The maximum number of domains the layout packet may describe
+#define MAX_DOMAINS 8
+
+// Data domain description, see domains.h
+struct domain_layout {
+	uint32_t period; // bucket period in seconds
+	float    scale;  // value units
+	uint8_t  pfirst; // first page index
+	uint8_t  npages; // pages count
+	uint8_t  input;  // the domain feeding this one or its own index if it is fed by samples
+	uint8_t  values; // values per bucket
+};
+
+// Data layout sent by transmitter after the report flagged by STATUS_LAYOUT
+// so the receiver and host are not bound to the transmitter build parameters.
+// The packet is cached by the receiver so it is protected by CRC32 as the data
+// pages are.
+struct layout_packet {
+	struct packet_hdr    hdr;
+	uint16_t             measuring_period;
+	uint8_t              domains; // the number of valid domain entries
+	uint8_t              features;
+	struct domain_layout domain[MAX_DOMAINS];
+	uint32_t             crc; // CRC32 of the packet fields above
+};
+
+#define LAYOUT_CRC_SZ offsetof(struct layout_packet, crc)
@@ -17,6 +17,18 @@ void receiver_on(receiver_cb_t cb);
 // Start receiving
 void receive_start(void);
 
+// Change frequency channel, the radio must be disabled
+static inline void radio_set_channel(unsigned ch)
+{
+    NRF_RADIO->FREQUENCY = ch;
+}
+
+// Change packet buffer, takes effect on the next transmit / receive start
+static inline void radio_set_packet(void* packet)
+{
+    NRF_RADIO->PACKETPTR = (uint32_t)packet;
+}
+
 static inline int radio_address_ok(void)
 {
     return NRF_RADIO->EVENTS_ADDRESS != 0;
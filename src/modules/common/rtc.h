@@ -14,6 +14,13 @@ void rtc_dummy_handler(nrf_drv_rtc_int_type_t int_type);
 
 unsigned rtc_current(void);
 
+// Set compare channel to the absolute time given by rtc_current() value
+static inline void rtc_cc_set(unsigned chan, unsigned time)
+{
+    ret_code_t err_code = nrf_drv_rtc_cc_set(&g_rtc, chan, time, true);
+    APP_ERROR_CHECK(err_code);
+}
+
 static inline void rtc_cc_schedule(unsigned chan, unsigned time)
 {
     ret_code_t err_code = nrf_drv_rtc_cc_set(&g_rtc, chan, rtc_current() + time, true);
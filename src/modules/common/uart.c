@@ -1,6 +1,7 @@
 #include "nrf.h"
 #include "uart.h"
 #include "bug.h"
+#include "crc32.h"
 #include "app_error.h"
 #include "nrf_drv_uart.h"
 #include "app_util_platform.h"
@@ -11,31 +12,98 @@
 
 #define LEN_PREFIX_LEN 6
 #define LEN_PREFIX_FMT "~%04x"
-#define TX_CHUNK_SZ 0xff
+#define TX_CHUNK_SZ 0xff // nrf_drv_uart_tx() length limit
+#define TX_PRINTF_MAX 128
 
-uint8_t  g_uart_rx_buff[UART_RX_BUFF_SZ];
-static uint8_t g_uart_tx_buff_[LEN_PREFIX_LEN+UART_TX_BUFF_SZ];
-uint8_t* g_uart_tx_buff = g_uart_tx_buff_ + LEN_PREFIX_LEN;
-unsigned g_uart_rx_len;
-unsigned g_uart_tx_len;
-static int g_uart_tx_len_;
+#define TX_IDX(pos) ((pos) & (UART_TX_BUFF_SZ-1))
 
+BUILD_BUG_ON(UART_TX_BUFF_SZ & (UART_TX_BUFF_SZ-1));
+
+// The commands are received to the queue while the previous ones are being
+// processed. Receiving is suspended while the queue is full so the hardware
+// flow control holds the host.
+static struct uart_cmd   g_uart_rx_queue[UART_RX_QUEUE];
+static volatile unsigned g_uart_rx_head;
+static volatile unsigned g_uart_rx_tail;
+static volatile int      g_uart_rx_stalled;
+static uint8_t           g_uart_rx_byte;
+static int               g_uart_rx_hunt; // skipping input after the corrupted frame
+static unsigned          g_uart_rx_ts;   // the last byte reception time
+
+// The transmit ring buffer. The frames are composed at its head starting with
+// the space reserved for the length prefix. Once flushed the frame is transmitted
+// from the interrupt handler while the next one may be composed. Positions are
+// free running, TX_IDX() gives the buffer index.
+static uint8_t           g_uart_tx_ring[UART_TX_BUFF_SZ];
+static unsigned          g_uart_tx_frame;     // current frame start
+static unsigned          g_uart_tx_head = LEN_PREFIX_LEN;
+static volatile unsigned g_uart_tx_flushed;   // end of the data to be transmitted
+static volatile unsigned g_uart_tx_tail;      // end of the data transmitted
+static volatile unsigned g_uart_tx_chunk;     // the number of bytes being transmitted
+
+// Start transmitting next chunk if there is data to send. Called with interrupts
+// disabled or in interrupt context.
 static void uart_tx_next(void)
 {
-    unsigned remaining = g_uart_tx_len - g_uart_tx_len_;
-    if (remaining > TX_CHUNK_SZ)
-        remaining = TX_CHUNK_SZ;
-    ret_code_t err_code = nrf_drv_uart_tx(g_uart_tx_buff + g_uart_tx_len_, remaining);
+    unsigned tail = g_uart_tx_tail;
+    unsigned len = g_uart_tx_flushed - tail;
+    unsigned contiguous = UART_TX_BUFF_SZ - TX_IDX(tail);
+    if (!len) {
+        g_uart_tx_chunk = 0;
+        return;
+    }
+    if (len > contiguous)
+        len = contiguous;
+    if (len > TX_CHUNK_SZ)
+        len = TX_CHUNK_SZ;
+    g_uart_tx_chunk = len;
+    ret_code_t err_code = nrf_drv_uart_tx(&g_uart_tx_ring[TX_IDX(tail)], len);
     APP_ERROR_CHECK(err_code);
 }
 
+static void uart_tx_write(unsigned pos, const void* data, unsigned sz)
+{
+    unsigned i = TX_IDX(pos), contiguous = UART_TX_BUFF_SZ - i;
+    if (sz <= contiguous) {
+        memcpy(&g_uart_tx_ring[i], data, sz);
+    } else {
+        memcpy(&g_uart_tx_ring[i], data, contiguous);
+        memcpy(g_uart_tx_ring, (const uint8_t*)data + contiguous, sz - contiguous);
+    }
+}
+
+int uart_tx_idle(void)
+{
+    return g_uart_tx_tail == g_uart_tx_flushed && g_uart_tx_head == g_uart_tx_frame + LEN_PREFIX_LEN;
+}
+
+unsigned uart_tx_avail(void)
+{
+    // Keep the space for the next frame prefix
+    return UART_TX_BUFF_SZ - LEN_PREFIX_LEN - (g_uart_tx_head - g_uart_tx_tail);
+}
+
+void uart_tx_discard(void)
+{
+    g_uart_tx_head = g_uart_tx_frame + LEN_PREFIX_LEN;
+}
+
 void uart_tx_flush_(char sep)
 {
-    BUG_ON(g_uart_tx_len > UART_TX_BUFF_SZ);
-    snprintf((char*)g_uart_tx_buff_, LEN_PREFIX_LEN, LEN_PREFIX_FMT, g_uart_tx_len);
-    g_uart_tx_buff_[LEN_PREFIX_LEN-1] = sep;
-    g_uart_tx_len_ = -LEN_PREFIX_LEN;
-    uart_tx_next();
+    char prefix[LEN_PREFIX_LEN];
+    unsigned len = g_uart_tx_head - g_uart_tx_frame - LEN_PREFIX_LEN;
+    snprintf(prefix, LEN_PREFIX_LEN, LEN_PREFIX_FMT, len);
+    prefix[LEN_PREFIX_LEN-1] = sep;
+    uart_tx_write(g_uart_tx_frame, prefix, LEN_PREFIX_LEN);
+    __disable_interrupt();
+    g_uart_tx_flushed = g_uart_tx_head;
+    if (!g_uart_tx_chunk) {
+        uart_tx_next();
+    }
+    __enable_interrupt();
+    g_uart_tx_frame = g_uart_tx_head;
+    g_uart_tx_head += LEN_PREFIX_LEN;
+    BUG_ON(g_uart_tx_head - g_uart_tx_tail > UART_TX_BUFF_SZ);
 }
 
 void uart_tx_flush(void)
@@ -48,41 +116,155 @@ void uart_tx_flush_binary(void)
     uart_tx_flush_('B');
 }
 
+void uart_tx_flush_part(void)
+{
+    if (g_uart_tx_head != g_uart_tx_frame + LEN_PREFIX_LEN) {
+        uart_tx_flush_(UART_SEP_PART);
+    }
+}
+
+void uart_tx_flush_crc(char sep)
+{
+    unsigned pos = g_uart_tx_frame + LEN_PREFIX_LEN;
+    unsigned i = TX_IDX(pos), len = g_uart_tx_head - pos;
+    unsigned contiguous = UART_TX_BUFF_SZ - i;
+    uint32_t crc;
+    if (len <= contiguous) {
+        crc = crc32(&g_uart_tx_ring[i], len);
+    } else {
+        crc = crc32up(crc32(&g_uart_tx_ring[i], contiguous), g_uart_tx_ring, len - contiguous);
+    }
+    uart_put(&crc, sizeof(crc));
+    uart_tx_flush_(sep);
+}
+
 static void uart_rx_next(void)
 {
-    ret_code_t err_code = nrf_drv_uart_rx(&g_uart_rx_buff[g_uart_rx_len], 1);
+    ret_code_t err_code = nrf_drv_uart_rx(&g_uart_rx_byte, 1);
     APP_ERROR_CHECK(err_code);
 }
 
+// Start receiving new command at the queue head
+static void uart_rx_reset(void)
+{
+    struct uart_cmd* cmd = &g_uart_rx_queue[g_uart_rx_head % UART_RX_QUEUE];
+    cmd->len = 0;
+    cmd->binary = 0;
+    cmd->crc_ok = 0;
+    cmd->crc = 0;
+}
+
+// Put received byte to the command at the queue head. Returns non zero if the command is completed.
+static int uart_rx_byte(uint8_t c)
+{
+    struct uart_cmd* cmd = &g_uart_rx_queue[g_uart_rx_head % UART_RX_QUEUE];
+    unsigned now = uart_rx_clock(), payload_end;
+    if (cmd->binary && (int)(now - g_uart_rx_ts) > UART_RX_TOUT) {
+        // The rest of the frame is lost
+        uart_rx_reset();
+    }
+    g_uart_rx_ts = now;
+    if (g_uart_rx_hunt) {
+        if (c != UART_BIN_SOF && c != *UART_EOL) {
+            return 0;
+        }
+        g_uart_rx_hunt = 0;
+        if (c == *UART_EOL) {
+            return 0;
+        }
+    }
+    if (!cmd->len && !cmd->binary && c == UART_BIN_SOF) {
+        cmd->binary = 1;
+        return 0;
+    }
+    if (!cmd->binary) {
+        if (c == *UART_EOL) {
+            cmd->data[cmd->len] = 0;
+            return 1;
+        }
+        if (cmd->len < UART_RX_BUFF_SZ-1) {
+            cmd->data[cmd->len++] = c;
+        }
+        return 0;
+    }
+    // Binary frame: op, id, length, payload, CRC32
+    if (cmd->len < UART_RX_BUFF_SZ) {
+        cmd->data[cmd->len] = c;
+    }
+    payload_end = cmd->len < UART_BIN_HDR_SZ ? UART_BIN_HDR_SZ : UART_BIN_HDR_SZ + cmd->data[2];
+    if (cmd->len < payload_end) {
+        cmd->crc = crc32up(cmd->crc, &c, 1);
+    } else {
+        // The CRC received cancels the one computed
+        cmd->crc ^= (uint32_t)c << (8 * (cmd->len - payload_end));
+    }
+    ++cmd->len;
+    if (cmd->len < UART_BIN_HDR_SZ || cmd->len != UART_BIN_HDR_SZ + cmd->data[2] + 4) {
+        return 0;
+    }
+    cmd->crc_ok = !cmd->crc;
+    g_uart_rx_hunt = !cmd->crc_ok;
+    return 1;
+}
+
 static void uart_event_handler(nrf_drv_uart_event_t * p_event, void * p_context)
 {
     if (p_event->type == NRF_DRV_UART_EVT_RX_DONE)
     {
         if (p_event->data.rxtx.bytes) {
             // byte received
-            if (g_uart_rx_len < UART_RX_BUFF_SZ-1) {
-                ++g_uart_rx_len;
-            }
             BUG_ON(p_event->data.rxtx.bytes != 1);
-            if (p_event->data.rxtx.p_data[0] == *UART_EOL) {
-                g_uart_rx_buff[g_uart_rx_len] = 0;
-                uart_rx_process();
-                g_uart_rx_len = 0;
+            if (uart_rx_byte(g_uart_rx_byte)) {
+                ++g_uart_rx_head;
+                uart_rx_notify();
+                if (g_uart_rx_head - g_uart_rx_tail >= UART_RX_QUEUE) {
+                    g_uart_rx_stalled = 1;
+                    return;
+                }
+                uart_rx_reset();
             }
         } // otherwise it was timeout
         uart_rx_next();
     }
     else if (p_event->type == NRF_DRV_UART_EVT_TX_DONE)
     {
-        g_uart_tx_len_ += p_event->data.rxtx.bytes;
-        if (g_uart_tx_len_ < (int)g_uart_tx_len) {
-            uart_tx_next();
-        } else {
-            g_uart_tx_len = 0;
-        }
+        // Chain the next chunk right away so there are no gaps in the output
+        g_uart_tx_tail += g_uart_tx_chunk;
+        uart_tx_next();
+        uart_tx_notify();
+    }
+}
+
+struct uart_cmd const* uart_rx_get(void)
+{
+    if (g_uart_rx_tail == g_uart_rx_head) {
+        return 0;
+    }
+    return &g_uart_rx_queue[g_uart_rx_tail % UART_RX_QUEUE];
+}
+
+void uart_rx_release(void)
+{
+    BUG_ON(g_uart_rx_tail == g_uart_rx_head);
+    ++g_uart_rx_tail;
+    if (g_uart_rx_stalled) {
+        // The slot is free now so receiving may be resumed
+        g_uart_rx_stalled = 0;
+        uart_rx_reset();
+        uart_rx_next();
     }
 }
 
+void uart_set_baudrate(nrf_uart_baudrate_t baudrate)
+{
+    nrf_uart_baudrate_set(NRF_UART0, baudrate);
+    // Drop partially received command since it may be garbled by baud rate mismatch
+    __disable_interrupt();
+    uart_rx_reset();
+    g_uart_rx_hunt = 0;
+    __enable_interrupt();
+}
+
 void uart_init(void)
 {
     nrf_drv_uart_config_t g_uart_cfg = NRF_DRV_UART_DEFAULT_CONFIG;
@@ -93,24 +275,20 @@ void uart_init(void)
 
 void uart_printf(const char* fmt, ...)
 {
+    char buff[TX_PRINTF_MAX];
     va_list v;
     va_start(v, fmt);
-    unsigned avail = UART_TX_BUFF_SZ - g_uart_tx_len;
-    int r = vsnprintf((char*)g_uart_tx_buff + g_uart_tx_len, avail, fmt, v);
-    BUG_ON((unsigned)r >= avail);
+    int r = vsnprintf(buff, sizeof(buff), fmt, v);
+    BUG_ON((unsigned)r >= sizeof(buff));
     if (r > 0) {
-        if (r < avail) {
-            g_uart_tx_len += r;
-        } else {
-            g_uart_tx_len += avail;
-        }
+        uart_put(buff, r);
     }
     va_end(v);
 }
 
 void uart_put(const void* data, unsigned sz)
 {
-    BUG_ON(g_uart_tx_len + sz > UART_TX_BUFF_SZ);
-    memcpy(g_uart_tx_buff + g_uart_tx_len, data, sz);
-    g_uart_tx_len += sz;
+    BUG_ON(sz > uart_tx_avail());
+    uart_tx_write(g_uart_tx_head, data, sz);
+    g_uart_tx_head += sz;
 }
@@ -1,18 +1,66 @@
 #pragma once
 
-#define UART_RX_BUFF_SZ 8
+#include "nrf_drv_uart.h"
+#include "nrf_drv_config.h"
+
+#define UART_RX_BUFF_SZ 16
+#define UART_RX_QUEUE   4
 #define UART_TX_BUFF_SZ 4096
 #define UART_EOL "\r"
 
-extern uint8_t  g_uart_rx_buff[UART_RX_BUFF_SZ];
-extern uint8_t* g_uart_tx_buff;
-extern unsigned g_uart_rx_len;
-extern unsigned g_uart_tx_len;
+// The text response too long for the transmit buffer is output by the frames
+// with UART_SEP_PART separator followed by the last one with UART_EOL separator.
+// The host joins them.
+#define UART_SEP_PART '+'
+
+// The binary request frame starts with UART_BIN_SOF followed by the header
+// (operation code, request id, payload length), payload and CRC32 of the
+// header and payload. The text command lines may not start with UART_BIN_SOF.
+// The frame not completed within UART_RX_TOUT is dropped. After the frame
+// failing CRC check the input is skipped till the next UART_BIN_SOF or end of
+// line since the frame length may be garbled.
+#define UART_BIN_SOF    '~'
+#define UART_BIN_HDR_SZ 3
+#define UART_RX_TOUT    (RTC0_CONFIG_FREQUENCY/10) // 100 msec in uart_rx_clock() ticks
+
+struct uart_cmd {
+    uint8_t  binary; // binary request frame, otherwise text command line
+    uint8_t  crc_ok; // binary frame CRC matches
+    uint16_t len;    // binary frame length, may exceed the buffer size
+    uint32_t crc;    // running CRC32 of the binary frame with the CRC received xored
+    uint8_t  data[UART_RX_BUFF_SZ]; // text command line is null terminated
+};
 
 void uart_init(void);
-void uart_rx_process(void);
+
+// Change baud rate. The transmission should be completed (see uart_tx_idle()).
+void uart_set_baudrate(nrf_uart_baudrate_t baudrate);
+
+// Called in interrupt context when the command is received
+void uart_rx_notify(void);
+// Called in interrupt context to get the current RTC counter
+unsigned uart_rx_clock(void);
+// Returns the oldest command received or NULL
+struct uart_cmd const* uart_rx_get(void);
+// Remove the command returned by uart_rx_get() from the queue
+void uart_rx_release(void);
+
+// Called in interrupt context when the space is freed in the transmit buffer
+void uart_tx_notify(void);
+// Returns the free space in the transmit buffer. The output does not wait for
+// the transmission so the caller must not exceed it.
+unsigned uart_tx_avail(void);
+// Returns non zero if all output is transmitted
+int uart_tx_idle(void);
+
 void uart_tx_flush(void);
 void uart_tx_flush_binary(void);
+// Flush the part of the long text response if there is any data put
+void uart_tx_flush_part(void);
+// Drop the data put since the last flush
+void uart_tx_discard(void);
+// Append CRC32 of the data and flush it as binary frame with the given separator
+void uart_tx_flush_crc(char sep);
 
 void uart_printf(const char* fmt, ...);
 void uart_put(const void* data, unsigned sz);
@@ -91,7 +91,7 @@
 #define RTC0_ENABLED 1
 
 #if (RTC0_ENABLED == 1)
-#define RTC0_CONFIG_FREQUENCY 8
+#define RTC0_CONFIG_FREQUENCY 256
 #define RTC0_CONFIG_IRQ_PRIORITY APP_IRQ_PRIORITY_LOW
 #define RTC0_CONFIG_RELIABLE     false
 
@@ -2,10 +2,13 @@
 #include "clock.h"
 #include "radio.h"
 #include "proto.h"
+#include "hop.h"
 #include "bug.h"
 #include "uart.h"
 #include "bmap.h"
 #include "rtc.h"
+#include "crc32.h"
+#include "page_cache.h"
 #include "app_error.h"
 
 #include <stdio.h>
@@ -29,23 +32,57 @@ static inline float vbat_adc_to_mv(unsigned v)
 }
 #endif
 
-#define PW_SCALE .2
-#define VCC_SCALE .0001
+// The report values units are the ones of the corresponding domains
+#define PW_SCALE  dom_scale(dom_fast_pw)
+#define VCC_SCALE dom_scale(dom_vbatt)
 
-// Packet buffer
-static union {
+union packet {
     struct packet_hdr      hdr;
     struct report_packet   report;
     struct data_req_packet data_req;
     struct data_packet     data;
-} g_pkt;
+    struct layout_packet   layout;
+};
+
+// Packet being processed or transmitted
+static union packet g_pkt;
+static unsigned     g_pkt_ts; // reception time
 
 static unsigned g_total_packets;
 static unsigned g_good_packets;
 
-static unsigned             g_report_packets;
-static struct report_packet g_last_report;
-static unsigned             g_last_report_ts;
+//---- events --------------------------------
+
+// RTC CC channels
+#define CC_HOP_TOUT  0
+#define CC_RX_WINDOW 1
+#define CC_BAUD_TOUT 2
+
+typedef enum {
+    evt_packet,    // packet received to the next receive slot
+    evt_uart_cmd,  // command line received from UART
+    evt_uart_tx,   // UART transmission completed
+    evt_hop_tout,  // data burst timeout
+    evt_rx_window, // reports receive window opens or closes
+    evt_baud_tout, // new baud rate was not verified in time
+} evt_t;
+
+// Events posted by interrupt handlers and processed by the main loop
+#define EVT_QUEUE_SZ 8
+
+static uint8_t           g_evt_queue[EVT_QUEUE_SZ];
+static volatile unsigned g_evt_head;
+static volatile unsigned g_evt_tail;
+
+// Packets are received in interrupt context while previous ones are waiting to be processed
+#define RX_SLOTS 2
+
+static union packet      g_rx_slots[RX_SLOTS];
+static uint8_t           g_rx_crc_ok[RX_SLOTS];
+static unsigned          g_rx_ts[RX_SLOTS];
+static volatile unsigned g_rx_head;
+static volatile unsigned g_rx_tail;
+static volatile int      g_rx_stalled; // no free slots to receive next packet
 
 //---- data transfer context -----------------
 
@@ -58,9 +95,6 @@ typedef enum {
     x_failed,
 } x_status_t;
 
-static x_status_t g_x_status = x_none;
-static uint32_t   g_x_start_sn;
-
 typedef enum {
     x_pg_unknown = 0,
     x_pg_unused,
@@ -69,35 +103,393 @@ typedef enum {
     x_pg_reading_data,
     x_pg_has_data,
     x_pg_aborted,
+    x_pg_cached, // found in the cache, waiting for output
 } x_pg_status_t;
 
-static x_pg_status_t        g_pg_status [DATA_PAGES];
-static struct data_page_hdr g_pg_headers[DATA_PAGES];
-static int                  g_pg_buff   [DATA_PAGES];
-static unsigned             g_pg_pending;
-static unsigned             g_pg_next;
+// The number of transfers that may run concurrently
+#define X_CONTEXTS 2
+
+// The number of page CRC mismatches after which the page is dropped
+#define X_CRC_RETRIES 4
+
+// The pages are downloaded to the cache autonomously once per X_SYNC_PERIOD
+// while the receiver is otherwise idle so the host may get them later without
+// waiting for the radio transfer. Only the pages newer than the cached ones are
+// downloaded and no more than the cache holds, so the pages evicted are not
+// fetched again on every sync wearing the flash.
+#define X_SYNC_PERIOD 3600 // sec
+
+struct x_context {
+    x_status_t           status;
+    uint8_t              dev_id;
+    uint8_t              sync;    // autonomous transfer to the cache
+    unsigned             sync_pages; // pages selected for caching
+    uint32_t             start_sn;
+    uint32_t             boot;    // transmitter boot identity at the start
+    uint32_t             hop_sn;  // last report sequence number
+    unsigned             hop_cnt; // data requests sent since that report
+    unsigned             get_pg_tout_ts;
+    unsigned             pg_meta_pending; // pages waiting for the header
+    unsigned             pg_pending;      // pages being read
+    unsigned             pg_next;
+    uint8_t              pg_status[DATA_PAGES];
+    uint8_t              fragments_required[DATA_PAGES];
+    // The page headers are kept split since the page index is implied and
+    // the fragment index is not used
+    uint8_t              pg_domain[DATA_PAGES];
+    uint8_t              pg_unused[DATA_PAGES];
+    uint32_t             pg_sn[DATA_PAGES];
+};
+
+static struct x_context g_x_ctx[X_CONTEXTS];
+
+// The pages being read are held by the buffers while their data is stored in
+// the pool of fragment slots. The slots are reserved for all fragments used by
+// the page when it is bound to the buffer and taken from the pool as the
+// fragments are received. The partially filled pages take less memory so
+// more pages may be read at once.
+//
+// The pool and the transfer tables take the most of the static RAM. The part
+// has 32KB, receiver.icf reserves 2KB for the stack and 512 bytes for the heap
+// so ~29.5KB are left. The transfer is given X_RAM_BUDGET of them, the rest is
+// taken by the UART TX ring (4KB), the transmitters table and the packet slots.
+#define BUFF_PAGES 24
+#define FRAG_SLOTS 128 // 16KB, the same as 16 full pages
+#define X_RAM_BUDGET (20*1024+512)
+#define FRAG_NONE  0xff
 
-#define BUFF_PAGES 16
-#define BUFF_RD_TOUT (10*RTC_HZ) // 10 sec
+// The transfer waits for the host to read the buffers as long as it takes
+// unless the host keeps silent for that long
+#define BUFF_RD_TOUT (600*RTC_HZ) // 10 min
+
+// The transfer start waits for the report that many transmitter measuring
+// periods, the transmitter is out of reach otherwise
+#define X_START_PERIODS 8
 
 typedef enum {
     x_buff_unused = 0,
     x_buff_reading,
-    x_buff_ready
+    x_buff_ready,
+    x_buff_caching, // waiting to be written to the cache
 } x_buff_status_t;
 
 static x_buff_status_t g_buff_status[BUFF_PAGES];
-static union data_page_fragmented g_buff[BUFF_PAGES];
+static uint8_t g_buff_crc_errors[BUFF_PAGES];
+static uint8_t g_buff_closed[BUFF_PAGES]; // the page is completed by transmitter so it may be cached
+static uint8_t g_buff_pg[BUFF_PAGES];
+static uint8_t g_buff_reserved[BUFF_PAGES]; // the number of fragment slots reserved
+static uint8_t g_buff_frag[BUFF_PAGES][DATA_PG_FRAGMENTS]; // fragment slots or FRAG_NONE
+static uint32_t g_buff_crc[BUFF_PAGES]; // the page CRC received with the last fragment
+static struct x_context* g_buff_owner[BUFF_PAGES];
+
+static uint32_t g_frag[FRAG_SLOTS][DATA_FRAG_SZ/4];
+static uint8_t  g_frag_free[FRAG_SLOTS]; // free slots stack
+static unsigned g_frag_free_cnt;
+static unsigned g_frag_avail; // the number of slots not reserved
+static uint32_t g_frag_erased[DATA_FRAG_SZ/4]; // the fragments not received are erased
+
+BUILD_BUG_ON(sizeof(g_frag) + sizeof(g_frag_free) + sizeof(g_frag_erased) + sizeof(g_x_ctx) +
+             sizeof(g_buff_status) + sizeof(g_buff_crc_errors) + sizeof(g_buff_closed) + sizeof(g_buff_pg) +
+             sizeof(g_buff_reserved) + sizeof(g_buff_frag) + sizeof(g_buff_crc) + sizeof(g_buff_owner)
+             > X_RAM_BUDGET);
+
+static void x_buff_init(void)
+{
+    unsigned i;
+    for (i = 0; i < FRAG_SLOTS; ++i) {
+        g_frag_free[i] = i;
+    }
+    g_frag_free_cnt = g_frag_avail = FRAG_SLOTS;
+    memset(g_frag_erased, 0xff, sizeof(g_frag_erased));
+    memset(g_buff_frag, FRAG_NONE, sizeof(g_buff_frag));
+}
+
+// Reserve the given total number of fragment slots for the buffer. Returns 0 if there are not enough free slots.
+static int x_buff_reserve(int b, unsigned cnt)
+{
+    if (cnt <= g_buff_reserved[b]) {
+        return 1;
+    }
+    if (cnt - g_buff_reserved[b] > g_frag_avail) {
+        return 0;
+    }
+    g_frag_avail -= cnt - g_buff_reserved[b];
+    g_buff_reserved[b] = cnt;
+    return 1;
+}
+
+// Release the buffer and its fragment slots
+static void x_buff_free(int b)
+{
+    unsigned f;
+    for (f = 0; f < DATA_PG_FRAGMENTS; ++f) {
+        if (g_buff_frag[b][f] != FRAG_NONE) {
+            g_frag_free[g_frag_free_cnt++] = g_buff_frag[b][f];
+            g_buff_frag[b][f] = FRAG_NONE;
+        }
+    }
+    g_frag_avail += g_buff_reserved[b];
+    g_buff_reserved[b] = 0;
+    g_buff_status[b] = x_buff_unused;
+    g_buff_owner[b] = 0;
+}
+
+static inline uint8_t const* x_buff_frag(int b, unsigned f)
+{
+    uint8_t s = g_buff_frag[b][f];
+    return (uint8_t const*)(s != FRAG_NONE ? g_frag[s] : g_frag_erased);
+}
+
+// Store the fragment received to the slot reserved
+static void x_buff_put_frag(int b, unsigned f, void const* data)
+{
+    if (g_buff_frag[b][f] == FRAG_NONE) {
+        BUG_ON(!g_frag_free_cnt);
+        g_buff_frag[b][f] = g_frag_free[--g_frag_free_cnt];
+    }
+    memcpy(g_frag[g_buff_frag[b][f]], data, DATA_FRAG_SZ);
+}
+
+// The page items are the fragments content between the header and the CRC trailer
+static inline unsigned x_frag_items_off(unsigned f)
+{
+    return f ? 0 : DATA_PAGE_HDR_SZ;
+}
+
+static inline unsigned x_frag_items_end(unsigned f)
+{
+    return f < DATA_PG_FRAGMENTS - 1 ? DATA_FRAG_SZ : DATA_FRAG_SZ - DATA_PAGE_CRC_SZ;
+}
+
+static uint32_t x_buff_items_crc(int b)
+{
+    unsigned f;
+    uint32_t crc = 0;
+    for (f = 0; f < DATA_PG_FRAGMENTS; ++f) {
+        unsigned off = x_frag_items_off(f);
+        crc = crc32up(crc, x_buff_frag(b, f) + off, x_frag_items_end(f) - off);
+    }
+    return crc;
+}
+
+// Output the page with the given header
+static void x_buff_output(int b, struct data_page_hdr const* h)
+{
+    unsigned f;
+    uart_put(h, DATA_PAGE_HDR_SZ);
+    for (f = 0; f < DATA_PG_FRAGMENTS; ++f) {
+        unsigned off = x_frag_items_off(f);
+        uart_put(x_buff_frag(b, f) + off, x_frag_items_end(f) - off);
+    }
+    uart_put(&g_buff_crc[b], DATA_PAGE_CRC_SZ);
+}
+
+//---- transmitters table --------------------
 
-static uint8_t g_fragments_required[DATA_PAGES];
+struct device {
+    struct report_packet last_report;
+    unsigned             last_report_ts;
+    unsigned             report_packets;
+    unsigned             good_packets;
+    uint32_t             sync_sn; // report sequence number at the last transfer start
+    struct x_context*    x; // transfer context if any
+    uint32_t             boot_ts; // transmitter start time estimated by the report, see dev_check_boot()
+    uint16_t             measuring_period; // taken from the layout, 0 till it is received
+    uint8_t              layout_wait; // the layout should follow the last report
+};
 
-static unsigned g_get_pg_tout_ts;
+static struct device g_dev[MAX_DEVICES];
+
+// The layouts are too large to be kept for every transmitter so the last ones
+// received are cached for the few of them. The least recently received one is
+// replaced by the layout of the transmitter not found in the cache.
+#define LAYOUT_CACHE_SZ 4
+
+static struct layout_entry {
+    struct layout_packet layout;
+    unsigned             seq; // g_layout_seq at the time of reception
+    uint8_t              valid;
+} g_layouts[LAYOUT_CACHE_SZ];
+
+static unsigned g_layout_seq;
+
+// The static RAM left by the stack and heap reserved by receiver.icf, see X_RAM_BUDGET.
+// The other static data besides the ones listed takes less than 1KB.
+#define RX_RAM_BUDGET (32*1024 - 0x800 - 0x200)
+
+BUILD_BUG_ON(X_RAM_BUDGET + UART_TX_BUFF_SZ + sizeof(g_dev) + sizeof(g_layouts) +
+             sizeof(g_rx_slots) + sizeof(g_pkt) + 1024 > RX_RAM_BUDGET);
+
+static struct layout_packet const* layout_find(unsigned dev_id)
+{
+    int i;
+    for (i = 0; i < LAYOUT_CACHE_SZ; ++i) {
+        if (g_layouts[i].valid && g_layouts[i].layout.hdr.dev_id == dev_id) {
+            return &g_layouts[i].layout;
+        }
+    }
+    return 0;
+}
+
+static void layout_put(struct layout_packet const* l)
+{
+    int i;
+    struct layout_entry* e = &g_layouts[0];
+    for (i = 0; i < LAYOUT_CACHE_SZ; ++i) {
+        if (g_layouts[i].valid && g_layouts[i].layout.hdr.dev_id == l->hdr.dev_id) {
+            e = &g_layouts[i];
+            break;
+        }
+        if (!g_layouts[i].valid || (e->valid && (int)(g_layouts[i].seq - e->seq) < 0)) {
+            e = &g_layouts[i];
+        }
+    }
+    e->layout = *l;
+    e->seq = ++g_layout_seq;
+    e->valid = 1;
+}
+
+// The transmitter which reports are shown on display
+#define DISPLAY_DEV_ID 0
+
+//---- channel hopping -----------------------
+
+struct chan_stat {
+    unsigned requested; // fragments requested
+    unsigned received;  // fragments received
+    unsigned loss;      // loss rate estimate in 1/HOP_LOSS_ONE units
+};
+
+static struct chan_stat g_chan_stat[HOP_CHANNELS];
+
+#define HOP_LOSS_ONE  256
+#define HOP_LOSS_MAX  (HOP_LOSS_ONE/4) // Channels with higher loss rate are skipped
+#define HOP_LOSS_AGE  4 // Skipped channel loss rate is decreased by 1/16
+#define HOP_LOSS_EWMA 2 // New loss rate is averaged with weight 1/4
+#define HOP_RX_TOUT   (RTC_HZ/4) // 250 msec of silence terminates data burst
+// The transmitter not heard on the new channel for that long has likely missed
+// the data request. It repeats the report on the reports channel then.
+#define HOP_CONFIRM_TOUT (RTC_HZ/64) // ~16 msec, 3 data fragments
+
+static int      g_hop_idx = -1; // current hop channel index or -1 if listening reports channel
+static int      g_hop_confirmed; // the transmitter was heard on the current channel
+static int      g_hop_burst;    // data burst is expected
+static unsigned g_hop_requested;
+static unsigned g_hop_received;
+static unsigned g_hop_ts;
 
 //--------------------------------------------------------
 
-static inline void x_set_status(x_status_t sta)
+static void evt_post(evt_t evt)
 {
-    g_x_status = sta;
+    __disable_interrupt();
+    BUG_ON(g_evt_head - g_evt_tail >= EVT_QUEUE_SZ);
+    g_evt_queue[g_evt_head % EVT_QUEUE_SZ] = evt;
+    ++g_evt_head;
+    __enable_interrupt();
+}
+
+// Called by the main loop only
+static inline int evt_get(evt_t* evt)
+{
+    if (g_evt_tail == g_evt_head) {
+        return 0;
+    }
+    *evt = (evt_t)g_evt_queue[g_evt_tail % EVT_QUEUE_SZ];
+    ++g_evt_tail;
+    return 1;
+}
+
+static inline void wait_events(void)
+{
+    // Taking an interrupt sets the event register so the event
+    // posted after the queue check makes WFE return immediately
+    if (g_evt_tail == g_evt_head) {
+        __WFE();
+    }
+}
+
+// Start receiving to the next free slot. The receiver must be in idle state.
+static void rx_next(void)
+{
+    if (g_rx_head - g_rx_tail >= RX_SLOTS) {
+        g_rx_stalled = 1;
+        return;
+    }
+    radio_set_packet(&g_rx_slots[g_rx_head % RX_SLOTS]);
+    receive_start();
+}
+
+// Radio END interrupt callback
+static void on_radio_end(void)
+{
+    g_rx_crc_ok[g_rx_head % RX_SLOTS] = receive_crc_ok();
+    g_rx_ts[g_rx_head % RX_SLOTS] = rtc_current();
+    ++g_rx_head;
+    evt_post(evt_packet);
+    rx_next();
+}
+
+// Turn on receiver, the radio must be disabled
+static void rx_on(void)
+{
+    g_rx_stalled = 0;
+    receiver_on_(on_radio_end);
+    rx_next();
+}
+
+static void rtc_handler(nrf_drv_rtc_int_type_t int_type)
+{
+    switch (int_type) {
+    case CC_HOP_TOUT:
+        rtc_cc_disable(CC_HOP_TOUT);
+        evt_post(evt_hop_tout);
+        break;
+    case CC_RX_WINDOW:
+        rtc_cc_disable(CC_RX_WINDOW);
+        evt_post(evt_rx_window);
+        break;
+    case CC_BAUD_TOUT:
+        rtc_cc_disable(CC_BAUD_TOUT);
+        evt_post(evt_baud_tout);
+        break;
+    default:
+        BUG();
+    }
+}
+
+static volatile int g_uart_cmd_evt; // evt_uart_cmd is posted but not processed yet
+
+void uart_rx_notify(void)
+{
+    // All queued commands are processed at once so single event is enough
+    if (!g_uart_cmd_evt) {
+        g_uart_cmd_evt = 1;
+        evt_post(evt_uart_cmd);
+    }
+}
+
+unsigned uart_rx_clock(void)
+{
+    return rtc_current();
+}
+
+static volatile int g_uart_tx_evt; // evt_uart_tx is posted but not processed yet
+
+void uart_tx_notify(void)
+{
+    // Post single event for consecutive chunks so the queue is not flooded
+    if (!g_uart_tx_evt) {
+        g_uart_tx_evt = 1;
+        evt_post(evt_uart_tx);
+    }
+}
+
+//--------------------------------------------------------
+
+static inline void x_set_status(struct x_context* x, x_status_t sta)
+{
+    x->status = sta;
 }
 
 static inline int pkt_hdr_valid(void)
@@ -106,346 +498,1280 @@ static inline int pkt_hdr_valid(void)
         return 0;
     if (g_pkt.hdr.magic != PROTOCOL_MAGIC)
         return 0;
+    if (g_pkt.hdr.dev_id >= MAX_DEVICES)
+        return 0;
     switch (g_pkt.hdr.type) {
     case packet_report:
         if (g_pkt.hdr.sz != sizeof(struct report_packet) - 1)
             return 0;
         break;
-    case packet_data_req:
-        if (g_pkt.hdr.sz != sizeof(struct data_req_packet) - 1)
-            return 0;
+    case packet_data_req:
+        if (g_pkt.hdr.sz != sizeof(struct data_req_packet) - 1)
+            return 0;
+        break;
+    case packet_data:
+        if (g_pkt.hdr.sz != sizeof(struct data_packet) - 1)
+            return 0;
+        break;
+    case packet_layout:
+        if (g_pkt.hdr.sz != sizeof(struct layout_packet) - 1)
+            return 0;
+        if (!g_pkt.layout.measuring_period || g_pkt.layout.domains > MAX_DOMAINS)
+            return 0;
+        if (g_pkt.layout.crc != crc32((uint8_t const*)&g_pkt.layout, LAYOUT_CRC_SZ))
+            return 0;
+        break;
+    default:
+        return 0;
+    }
+    return 1;
+}
+
+static inline unsigned last_report_age(struct device const* dev)
+{
+    return (rtc_current() - dev->last_report_ts) / RTC_HZ;
+}
+
+// The transmitter measuring period, the receiver's own one till the layout is received
+static inline unsigned dev_measuring_period(struct device const* dev)
+{
+    return dev->measuring_period ? dev->measuring_period : MEASURING_PERIOD;
+}
+
+static inline unsigned transmitter_uptime(struct device const* dev)
+{
+    return last_report_age(dev) + dev->last_report.sn * dev_measuring_period(dev);
+}
+
+static void get_transmitter_uptime(struct device const* dev)
+{
+    if (!dev->report_packets) {
+        uart_printf(UART_EOL);
+    } else {
+        uart_printf("%u" UART_EOL, transmitter_uptime(dev));
+    }
+    uart_tx_flush();
+}
+
+static void print_dev_stat(struct device const* dev)
+{
+    int i, pg_cnt = 0;
+    for (i = 0; i < DATA_PAGES; ++i) {
+           if (bmap_get_bit(dev->last_report.page_bitmap, i))
+               ++pg_cnt;
+    }
+    uart_printf("status = %#x"  UART_EOL, dev->last_report.hdr.status);
+    uart_printf("PW     = %.1f" UART_EOL, PW_SCALE * dev->last_report.power);
+    uart_printf("Vbatt  = %.4f" UART_EOL, VCC_SCALE * dev->last_report.vbatt);
+    uart_printf("Energy = %.3f kWh" UART_EOL, dev->last_report.energy / 1000.);
+    uart_printf("SN     = %u"   UART_EOL, dev->last_report.sn);
+    uart_printf("%u pages used" UART_EOL, pg_cnt);
+    uart_printf("%u pages cached" UART_EOL, page_cache_count(dev - g_dev));
+    uart_printf("%u report packets received" UART_EOL, dev->report_packets);
+    uart_printf("%u valid packets received" UART_EOL, dev->good_packets);
+    uart_printf("last packet was received %u sec ago" UART_EOL, last_report_age(dev));
+}
+
+static void print_layout(struct layout_packet const* layout)
+{
+    int d;
+    uart_printf("measuring period = %u" UART_EOL, layout->measuring_period);
+    uart_printf("features = %#x" UART_EOL, layout->features);
+    for (d = 0; d < layout->domains; ++d) {
+        struct domain_layout const* l = &layout->domain[d];
+        uart_printf("domain %u: period %u, pages %u-%u, input %u, %u values, scale %g" UART_EOL,
+            d, l->period, l->pfirst, l->pfirst + l->npages - 1, l->input, l->values, l->scale);
+    }
+}
+
+static void get_layout(int dev_id)
+{
+    struct layout_packet const* l = layout_find(dev_id);
+    if (!l) {
+        uart_printf("no layout received" UART_EOL);
+    } else {
+        print_layout(l);
+    }
+    uart_tx_flush();
+}
+
+static void print_total_stat(void)
+{
+    if (g_total_packets) {
+        int i;
+        uart_printf("total packets received: %u (%u%% good)" UART_EOL,
+            g_total_packets, 100 * g_good_packets / g_total_packets);
+        for (i = 0; i < HOP_CHANNELS; ++i) {
+            struct chan_stat const* st = &g_chan_stat[i];
+            if (st->requested) {
+                uart_printf("channel %u: %u of %u fragments received, loss %u%%" UART_EOL,
+                    g_hop_channels[i], st->received, st->requested, 100 * st->loss / HOP_LOSS_ONE);
+            }
+        }
+    }
+}
+
+// The stat of every transmitter may not fit the transmit buffer so it is output
+// by parts as the transmission progresses (see UART_SEP_PART). The commands are
+// not processed till it is completed.
+#define STAT_PART_MAX_SZ 640 // the transmitter or total stat output limit
+
+static int      g_stat_dev = -1; // the next transmitter to print, -1 if not printing
+static unsigned g_stat_cnt;      // the transmitters printed
+
+// Continue printing the stat of every transmitter. Returns 0 if not completed.
+static int get_stat_all(void)
+{
+    for (; g_stat_dev < MAX_DEVICES; ++g_stat_dev) {
+        if (!g_dev[g_stat_dev].report_packets) {
+            continue;
+        }
+        if (uart_tx_avail() < STAT_PART_MAX_SZ) {
+            uart_tx_flush_part();
+            return 0;
+        }
+        uart_printf("[%u]" UART_EOL, g_stat_dev);
+        print_dev_stat(&g_dev[g_stat_dev]);
+        ++g_stat_cnt;
+    }
+    if (uart_tx_avail() < STAT_PART_MAX_SZ) {
+        uart_tx_flush_part();
+        return 0;
+    }
+    if (!g_stat_cnt) {
+        uart_printf("no valid reports received" UART_EOL);
+    }
+    print_total_stat();
+    uart_tx_flush();
+    g_stat_dev = -1;
+    return 1;
+}
+
+static void get_stat(int dev_id)
+{
+    if (dev_id < 0) {
+        g_stat_dev = 0;
+        g_stat_cnt = 0;
+        get_stat_all();
+        return;
+    }
+    if (!g_dev[dev_id].report_packets) {
+        uart_printf("no valid reports received" UART_EOL);
+    } else {
+        print_dev_stat(&g_dev[dev_id]);
+    }
+    print_total_stat();
+    uart_tx_flush();
+}
+
+static inline int x_is_active(struct x_context const* x)
+{
+    return  x->status != x_none &&
+            x->status != x_completed &&
+            x->status != x_failed;
+}
+
+static inline void x_upd_tout(struct x_context* x)
+{
+    x->get_pg_tout_ts = rtc_current() + BUFF_RD_TOUT;
+}
+
+static inline void x_upd_start_tout(struct x_context* x)
+{
+    x->get_pg_tout_ts = rtc_current() + X_START_PERIODS * dev_measuring_period(&g_dev[x->dev_id]) * RTC_HZ;
+}
+
+// Fail the transfers not started in time so they do not hold the contexts and
+// keep the receiver on
+static void x_check_start_tout(void)
+{
+    int i;
+    for (i = 0; i < X_CONTEXTS; ++i) {
+        struct x_context* x = &g_x_ctx[i];
+        if (x->status == x_starting && (int)(rtc_current() - x->get_pg_tout_ts) > 0) {
+            x_set_status(x, x_failed);
+        }
+    }
+}
+
+static void x_release_buffers(struct x_context const* x)
+{
+    int b;
+    for (b = 0; b < BUFF_PAGES; ++b) {
+        if (g_buff_owner[b] == x) {
+            x_buff_free(b);
+        }
+    }
+}
+
+// Find the buffer the page is being read to. Returns -1 if there are no such buffer.
+static int x_pg_buff(struct x_context const* x, unsigned pg)
+{
+    int b;
+    for (b = 0; b < BUFF_PAGES; ++b) {
+        if (g_buff_status[b] == x_buff_reading && g_buff_owner[b] == x && g_buff_pg[b] == pg) {
+            return b;
+        }
+    }
+    return -1;
+}
+
+static void x_pg_set_hdr(struct x_context* x, unsigned pg, struct data_page_hdr const* h)
+{
+    x->pg_domain[pg] = h->domain;
+    x->pg_unused[pg] = h->unused_fragments;
+    x->pg_sn[pg] = h->sn;
+}
+
+static void x_pg_get_hdr(struct x_context const* x, unsigned pg, struct data_page_hdr* h)
+{
+    h->domain = x->pg_domain[pg];
+    h->page_idx = pg;
+    h->unused_fragments = x->pg_unused[pg];
+    h->fragment_ = 0;
+    h->sn = x->pg_sn[pg];
+}
+
+// Find transfer context for the given transmitter. Either the context already
+// bound to it is returned or the context of some inactive transfer is taken over.
+static struct x_context* x_get_context(unsigned dev_id)
+{
+    int i;
+    struct device* dev = &g_dev[dev_id];
+    if (dev->x) {
+        return dev->x;
+    }
+    for (i = 0; i < X_CONTEXTS; ++i) {
+        struct x_context* x = &g_x_ctx[i];
+        if (!x_is_active(x)) {
+            if (x->status != x_none) {
+                BUG_ON(g_dev[x->dev_id].x != x);
+                g_dev[x->dev_id].x = 0;
+            }
+            x_release_buffers(x);
+            x->dev_id = dev_id;
+            x_set_status(x, x_none);
+            dev->x = x;
+            return x;
+        }
+    }
+    return 0;
+}
+
+// Start data transfer, returns 0 if there are no free transfer contexts
+static int x_start_(unsigned dev_id)
+{
+    struct x_context* x = x_get_context(dev_id);
+    if (!x) {
+        return 0;
+    }
+    x_release_buffers(x);
+    x_upd_start_tout(x);
+    x->sync = 0;
+    g_dev[dev_id].sync_sn = g_dev[dev_id].last_report.sn;
+    x_set_status(x, x_starting);
+    return 1;
+}
+
+// Start the transfer of the pages cached for the transmitter. The radio is not
+// used so the transfer is completed right away.
+static int x_start_cached_(unsigned dev_id)
+{
+    struct x_context* x = x_get_context(dev_id);
+    struct data_page const* p;
+    unsigned slot = 0;
+    if (!x) {
+        return 0;
+    }
+    x_release_buffers(x);
+    x_upd_tout(x);
+    x->sync = 0;
+    x->boot = g_dev[dev_id].boot_ts;
+    memset(x->pg_status, x_pg_unused, sizeof(x->pg_status));
+    while ((p = page_cache_next(dev_id, &slot))) {
+        x_pg_set_hdr(x, p->h.page_idx, &p->h);
+        x->pg_status[p->h.page_idx] = x_pg_cached;
+    }
+    x_set_status(x, x_completed);
+    return 1;
+}
+
+static void x_start(unsigned dev_id, int cached)
+{
+    if (!(cached ? x_start_cached_(dev_id) : x_start_(dev_id))) {
+        uart_printf("too many transfers" UART_EOL);
+    } else {
+        uart_printf(UART_EOL);
+    }
+    uart_tx_flush();
+}
+
+static inline uint8_t x_dev_status(unsigned dev_id)
+{
+    struct x_context const* x = g_dev[dev_id].x;
+    return x ? x->status : x_none;
+}
+
+static void x_get_status(unsigned dev_id)
+{
+    uint8_t sta = x_dev_status(dev_id);
+    uart_put(&sta, 1);
+    uart_tx_flush_binary();
+}
+
+static inline int x_has_data(struct x_context const* x)
+{
+    return x && (x->status == x_reading_data || x->status == x_completed);
+}
+
+// Find the buffer with data page ready for output. Returns -1 if there are no such buffer.
+static int x_ready_buff(struct x_context const* x)
+{
+    int b;
+    if (!x_has_data(x)) {
+        return -1;
+    }
+    for (b = 0; b < BUFF_PAGES; ++b) {
+        if (g_buff_status[b] == x_buff_ready && g_buff_owner[b] == x) {
+            return b;
+        }
+    }
+    return -1;
+}
+
+// Find the page to be output from the cache. Returns -1 if there are no such pages.
+static int x_cached_pg(struct x_context* x)
+{
+    unsigned pg;
+    if (!x_has_data(x)) {
+        return -1;
+    }
+    for (pg = 0; pg < DATA_PAGES; ++pg) {
+        if (x->pg_status[pg] == x_pg_cached) {
+            if (page_cache_find(x->dev_id, x->boot, pg, x->pg_sn[pg])) {
+                return pg;
+            }
+            // evicted by other pages
+            x->pg_status[pg] = x_pg_aborted;
+        }
+    }
+    return -1;
+}
+
+static inline int x_page_ready(struct x_context* x)
+{
+    return x_ready_buff(x) >= 0 || x_cached_pg(x) >= 0;
+}
+
+// Output data page ready and release its buffer. The buffer is written to the
+// cache afterwards if the page is completed by the transmitter.
+static void x_put_page(struct x_context* x)
+{
+    int b = x_ready_buff(x);
+    unsigned pg;
+    struct data_page_hdr h;
+    if (b < 0) {
+        struct data_page const* p;
+        pg = x_cached_pg(x);
+        BUG_ON(pg >= DATA_PAGES);
+        p = page_cache_find(x->dev_id, x->boot, pg, x->pg_sn[pg]);
+        x_pg_get_hdr(x, pg, &h);
+        uart_put(&h, DATA_PAGE_HDR_SZ);
+        uart_put(p->ibytes, DATA_PAGE_SZ - DATA_PAGE_HDR_SZ);
+        x->pg_status[pg] = x_pg_has_data;
+        return;
+    }
+    pg = g_buff_pg[b];
+    BUG_ON(x->pg_status[pg] != x_pg_has_data);
+    x_pg_get_hdr(x, pg, &h);
+    x_buff_output(b, &h);
+    if (g_buff_closed[b]) {
+        g_buff_status[b] = x_buff_caching;
+    } else {
+        x_buff_free(b);
+    }
+}
+
+// Status byte, data page and CRC32
+#define X_FRAME_MAX_SZ (1 + DATA_PAGE_SZ + 4)
+
+// Put the transfer status and data page if available to the output
+static void x_get_page_(unsigned dev_id)
+{
+    struct x_context* x = g_dev[dev_id].x;
+    uint8_t sta = x_dev_status(dev_id);
+    // The page is left in the buffer if the output is congested, the host will query it later
+    int ready = uart_tx_avail() >= X_FRAME_MAX_SZ && x_page_ready(x);
+    uart_put(&sta, 1);
+    if (x_has_data(x)) {
+        x_upd_tout(x);
+    }
+    if (ready) {
+        x_put_page(x);
+    }
+}
+
+static void x_get_page(unsigned dev_id)
+{
+    x_get_page_(dev_id);
+    uart_tx_flush_binary();
+}
+
+//---- data streaming ------------------------
+
+// The pages are pushed to the host as soon as they are received instead of
+// being polled by qd commands. Every frame carries the transfer status and
+// optionally the data page followed by CRC32. The host grants X_STREAM_CREDITS
+// frames on stream start and one more frame by every 'a' command acknowledging
+// the frame received. The stream is terminated by the frame without page
+// having the final transfer status.
+#define X_STREAM_CREDITS 3
+
+static int      g_x_stream_dev = -1;
+static unsigned g_x_stream_credits;
+static uint8_t  g_x_stream_status; // last status sent
+
+static void x_stream_start(unsigned dev_id)
+{
+    g_x_stream_dev = dev_id;
+    g_x_stream_credits = X_STREAM_CREDITS;
+    // Invalid status makes the first frame to be sent by x_stream_push() immediately
+    g_x_stream_status = 0xff;
+}
+
+static void x_stream_ack(void)
+{
+    if (g_x_stream_dev >= 0 && g_x_stream_credits < X_STREAM_CREDITS) {
+        ++g_x_stream_credits;
+    }
+}
+
+// Called by the main loop to send the next frame if possible
+static void x_stream_push(void)
+{
+    struct x_context* x;
+    uint8_t sta;
+    int ready, done;
+    if (g_x_stream_dev < 0 || !g_x_stream_credits || uart_tx_avail() < X_FRAME_MAX_SZ) {
+        return;
+    }
+    x = g_dev[g_x_stream_dev].x;
+    sta = x_dev_status(g_x_stream_dev);
+    ready = x_page_ready(x);
+    if (x_has_data(x)) {
+        // The host is ready to receive data
+        x_upd_tout(x);
+    }
+    done = !ready && (!x || !x_is_active(x));
+    if (!ready && !done && sta == g_x_stream_status) {
+        return;
+    }
+    uart_put(&sta, 1);
+    if (ready) {
+        x_put_page(x);
+    }
+    uart_tx_flush_crc('C');
+    --g_x_stream_credits;
+    g_x_stream_status = sta;
+    if (done) {
+        g_x_stream_dev = -1;
+    }
+}
+
+//---- baud rate negotiation -----------------
+
+// The host requests new baud rate by b<rate> command. The receiver responds at
+// the current rate, switches to the new one as soon as the response is transmitted
+// and waits for the v command confirming the host has switched as well. The
+// previous rate is restored if anything else is received or nothing is received
+// in BAUD_VERIFY_TOUT. The rate is reset to default on restart.
+#define BAUD_VERIFY_TOUT RTC_HZ
+
+typedef enum {
+    baud_idle,
+    baud_switching, // waiting the response transmission completion
+    baud_verifying, // waiting the host confirmation at the new rate
+} baud_state_t;
+
+static const struct {
+    unsigned            rate;
+    nrf_uart_baudrate_t cfg;
+} g_baud_rates[] = {
+    {230400,  NRF_UART_BAUDRATE_230400},
+    {460800,  NRF_UART_BAUDRATE_460800},
+    {921600,  NRF_UART_BAUDRATE_921600},
+    {1000000, NRF_UART_BAUDRATE_1000000},
+};
+
+#define BAUD_RATES (sizeof(g_baud_rates)/sizeof(g_baud_rates[0]))
+
+static baud_state_t        g_baud_state;
+static nrf_uart_baudrate_t g_baud_cfg = UART0_CONFIG_BAUDRATE;
+static nrf_uart_baudrate_t g_baud_new;
+
+static void baud_request(const char* str)
+{
+    unsigned i, rate = 0;
+    for (; *str >= '0' && *str <= '9'; ++str) {
+        rate = rate * 10 + *str - '0';
+    }
+    for (i = 0; i < BAUD_RATES; ++i) {
+        if (g_baud_rates[i].rate == rate && !*str) {
+            break;
+        }
+    }
+    if (i >= BAUD_RATES) {
+        uart_printf("unsupported baud rate" UART_EOL);
+    } else {
+        g_baud_new = g_baud_rates[i].cfg;
+        g_baud_state = baud_switching;
+        uart_printf(UART_EOL);
+    }
+    uart_tx_flush();
+}
+
+static void baud_restore(void)
+{
+    rtc_cc_disable(CC_BAUD_TOUT);
+    uart_set_baudrate(g_baud_cfg);
+    g_baud_state = baud_idle;
+}
+
+static void baud_verify(const char* cmd)
+{
+    if (cmd[0] != 'v' || cmd[1]) {
+        baud_restore();
+        return;
+    }
+    rtc_cc_disable(CC_BAUD_TOUT);
+    g_baud_cfg = g_baud_new;
+    g_baud_state = baud_idle;
+    uart_printf(UART_EOL);
+    uart_tx_flush();
+}
+
+// Called by the main loop to switch baud rate when output is completed
+static void baud_switch(void)
+{
+    if (g_baud_state == baud_switching && uart_tx_idle()) {
+        uart_set_baudrate(g_baud_new);
+        g_baud_state = baud_verifying;
+        rtc_cc_schedule(CC_BAUD_TOUT, BAUD_VERIFY_TOUT);
+    }
+}
+
+static inline void get_help(void)
+{
+    uart_printf(" r  - print last reports and reception stat" UART_EOL);
+    uart_printf(" u  - get transmitter uptime in seconds" UART_EOL);
+    uart_printf(" l  - print transmitter data layout" UART_EOL);
+    uart_printf(" s  - start data transfer" UART_EOL);
+    uart_printf(" k  - start transfer of the pages cached by receiver" UART_EOL);
+    uart_printf(" q  - query data transfer status" UART_EOL);
+    uart_printf(" qd - query data transfer status and data page if available" UART_EOL);
+    uart_printf(" p  - stream data transfer status and data pages" UART_EOL);
+    uart_printf(" a  - acknowledge streamed frame" UART_EOL);
+    uart_printf(" b<rate> - switch to the given baud rate, confirmed by v command at new rate" UART_EOL);
+    uart_printf(" ?  - this help" UART_EOL);
+    uart_printf("The command may be followed by the transmitter id (0 by default)" UART_EOL);
+    uart_printf("Commands starting with ~ are binary requests used by programs" UART_EOL);
+    uart_tx_flush();
+}
+
+// Parse transmitter id following the command. Returns -1 if its missing.
+static int parse_dev_id(const char* str)
+{
+    int dev_id = -1;
+    for (; *str >= '0' && *str <= '9'; ++str) {
+        if (dev_id < 0) {
+            dev_id = 0;
+        }
+        dev_id = dev_id * 10 + *str - '0';
+        if (dev_id >= MAX_DEVICES) {
+            return MAX_DEVICES;
+        }
+    }
+    return dev_id;
+}
+
+static void text_cmd_process(const char* cmd)
+{
+    int dev_id;
+    if (cmd[0] == 'b') {
+        baud_request(cmd + 1);
+        return;
+    }
+    dev_id = parse_dev_id(cmd[0] == 'q' && cmd[1] == 'd' ? cmd + 2 : cmd + 1);
+    if (dev_id >= MAX_DEVICES) {
+        uart_printf("invalid transmitter id" UART_EOL);
+        uart_tx_flush();
+        return;
+    }
+    switch (cmd[0]) {
+    case 'r':
+        get_stat(dev_id);
+        return;
+    case '?':
+        get_help();
+        return;
+    case 'a':
+        x_stream_ack();
+        return;
+    }
+    if (dev_id < 0) {
+        dev_id = 0;
+    }
+    switch (cmd[0]) {
+    case 'u':
+        get_transmitter_uptime(&g_dev[dev_id]);
+        break;
+    case 'l':
+        get_layout(dev_id);
+        break;
+    case 's':
+        x_start(dev_id, 0);
+        break;
+    case 'k':
+        x_start(dev_id, 1);
+        break;
+    case 'q':
+        if (cmd[1] == 'd') {
+            x_get_page(dev_id);
+        } else {
+            x_get_status(dev_id);
+        }
+        break;
+    case 'p':
+        x_stream_start(dev_id);
+        break;
+    default:
+        uart_printf("invalid command, send ? to get help" UART_EOL);
+        uart_tx_flush();
+    }
+}
+
+//---- binary protocol -----------------------
+
+// Binary requests provide the same functionality as text commands but are
+// intended for programs. The request payload is the transmitter id if the
+// operation needs one. The response is framed as ~LLLLR followed by the
+// operation code, request id, error code, the operation result and CRC32.
+// Since the commands are queued the host may send several requests without
+// waiting for responses and match them by request id.
+
+typedef enum {
+    op_status = 1, // transfer status
+    op_page,       // transfer status and data page if available
+    op_start,      // start data transfer
+    op_uptime,     // transmitter uptime in seconds
+    op_report,     // reports count, last report age in seconds and the report packet
+    op_stat,       // total and valid packets count
+    op_start_cached, // start transfer of the cached pages
+    op_layout,     // the last layout packet
+} op_t;
+
+typedef enum {
+    err_ok,
+    err_crc,     // the request is corrupted
+    err_op,      // unknown operation
+    err_arg,     // invalid transmitter id
+    err_busy,    // too many transfers
+    err_no_data, // no reports received
+} op_err_t;
+
+// Operation code, request id, error code
+#define BIN_RESP_HDR_SZ 3
+
+static void bin_put_u32(uint32_t v)
+{
+    uart_put(&v, sizeof(v));
+}
+
+static op_err_t bin_op_process(uint8_t op, uint8_t const* payload, unsigned len)
+{
+    struct device const* dev;
+    struct layout_packet const* l;
+    uint8_t sta;
+    if (op == op_stat) {
+        bin_put_u32(g_total_packets);
+        bin_put_u32(g_good_packets);
+        return err_ok;
+    }
+    if (op < op_status || op > op_layout) {
+        return err_op;
+    }
+    if (len < 1 || payload[0] >= MAX_DEVICES) {
+        return err_arg;
+    }
+    dev = &g_dev[payload[0]];
+    switch (op) {
+    case op_status:
+        sta = x_dev_status(payload[0]);
+        uart_put(&sta, 1);
+        break;
+    case op_page:
+        x_get_page_(payload[0]);
+        break;
+    case op_start:
+        if (!x_start_(payload[0])) {
+            return err_busy;
+        }
+        break;
+    case op_start_cached:
+        if (!x_start_cached_(payload[0])) {
+            return err_busy;
+        }
+        break;
+    case op_uptime:
+        if (!dev->report_packets) {
+            return err_no_data;
+        }
+        bin_put_u32(transmitter_uptime(dev));
+        break;
+    case op_report:
+        if (!dev->report_packets) {
+            return err_no_data;
+        }
+        bin_put_u32(dev->report_packets);
+        bin_put_u32(last_report_age(dev));
+        uart_put(&dev->last_report, sizeof(dev->last_report));
         break;
-    case packet_data:
-        if (g_pkt.hdr.sz != sizeof(struct data_packet) - 1)
-            return 0;
+    case op_layout:
+        if (!(l = layout_find(payload[0]))) {
+            return err_no_data;
+        }
+        uart_put(l, sizeof(*l));
         break;
-    default:
-        return 0;
     }
-    return 1;
+    return err_ok;
 }
 
-static inline unsigned last_report_age(void)
+static void bin_cmd_process(struct uart_cmd const* cmd)
 {
-    return (rtc_current() - g_last_report_ts) / RTC_HZ;
-}
-
-static void get_transmitter_uptime(void)
-{
-    if (!g_report_packets) {
-        uart_printf(UART_EOL);
-    } else {
-        uart_printf("%u" UART_EOL, last_report_age() + g_last_report.sn * MEASURING_PERIOD);
+    uint8_t hdr[BIN_RESP_HDR_SZ] = {cmd->data[0], cmd->data[1], err_crc};
+    unsigned len = cmd->data[2];
+    // The CRC is verified on reception, the whole frame should fit the buffer
+    if (cmd->crc_ok && cmd->len <= UART_RX_BUFF_SZ) {
+        hdr[2] = err_ok;
     }
-    uart_tx_flush();
+    uart_put(hdr, sizeof(hdr));
+    if (hdr[2] == err_ok) {
+        op_err_t err = bin_op_process(hdr[0], &cmd->data[UART_BIN_HDR_SZ], len);
+        if (err != err_ok) {
+            // Drop the result, respond with error code only
+            uart_tx_discard();
+            hdr[2] = err;
+            uart_put(hdr, sizeof(hdr));
+        }
+    }
+    uart_tx_flush_crc('R');
 }
 
-static void get_stat(void)
+// The space required for the largest binary response
+#define BIN_RESP_MAX_SZ (BIN_RESP_HDR_SZ + X_FRAME_MAX_SZ)
+
+// Process queued commands while there is space for the responses. Text commands
+// are processed when all output is transmitted since their responses may be long.
+static void uart_cmd_process(void)
 {
-    if (!g_report_packets) {
-        uart_printf("no valid reports received" UART_EOL);
-    } else {
-        int i, pg_cnt = 0;
-        for (i = 0; i < DATA_PAGES; ++i) {
-               if (bmap_get_bit(g_last_report.page_bitmap, i))
-                   ++pg_cnt;
-        }
-        uart_printf("status = %#x"  UART_EOL, g_last_report.hdr.status);
-        uart_printf("PW     = %.1f" UART_EOL, PW_SCALE * g_last_report.power);
-        uart_printf("Vbatt  = %.4f" UART_EOL, VCC_SCALE * g_last_report.vbatt);
-        uart_printf("SN     = %u"   UART_EOL, g_last_report.sn);
-        uart_printf("%u pages used" UART_EOL, pg_cnt);
-        uart_printf("%u report packets received" UART_EOL, g_report_packets);
-        uart_printf("last packet was received %u sec ago" UART_EOL, last_report_age());        
+    struct uart_cmd const* cmd;
+    if (g_stat_dev >= 0 && !get_stat_all()) {
+        return;
     }
-    if (g_total_packets) {
-        uart_printf("total packets received: %u (%u%% good)" UART_EOL,
-            g_total_packets, 100 * g_good_packets / g_total_packets);
+    while (g_baud_state != baud_switching && (cmd = uart_rx_get())) {
+        if (cmd->binary ? uart_tx_avail() < BIN_RESP_MAX_SZ : !uart_tx_idle()) {
+            // will be called again on transmission progress
+            break;
+        }
+        if (g_baud_state == baud_verifying) {
+            baud_verify(cmd->binary ? "" : (const char*)cmd->data);
+        } else if (cmd->binary) {
+            bin_cmd_process(cmd);
+        } else {
+            text_cmd_process((const char*)cmd->data);
+        }
+        uart_rx_release();
     }
-    uart_tx_flush();
 }
 
-static inline int x_is_active(void)
+static inline void pkt_hdr_init(uint8_t type, uint8_t sz, uint8_t dev_id)
 {
-    return  g_x_status != x_none &&
-            g_x_status != x_completed &&
-            g_x_status != x_failed;
+    g_pkt.hdr.sz      = sz - 1;
+    g_pkt.hdr.version = PROTOCOL_VERSION;
+    g_pkt.hdr.status  = 0;
+    g_pkt.hdr.type    = type;
+    g_pkt.hdr.dev_id  = dev_id;
+    g_pkt.hdr.magic   = PROTOCOL_MAGIC;
 }
 
-static inline void x_upd_tout(void)
+static unsigned bits_count(uint8_t const* bm, unsigned sz)
 {
-    g_get_pg_tout_ts = rtc_current() + BUFF_RD_TOUT;
+    unsigned i, cnt = 0;
+    for (i = 0; i < sz; ++i) {
+        uint8_t v = bm[i];
+        for (; v; v &= v - 1) {
+            ++cnt;
+        }
+    }
+    return cnt;
 }
 
-static void x_start()
+// Choose the next channel following the hop schedule while skipping lossy channels
+static unsigned hop_select(struct x_context* x)
 {
-    x_upd_tout();
-    x_set_status(x_starting);
-    uart_printf(UART_EOL);
-    uart_tx_flush();
+    unsigned n, best = 0, best_loss = ~0;
+    for (n = 0; n < HOP_CHANNELS; ++n) {
+        unsigned i = hop_index(x->hop_sn, x->hop_cnt++);
+        struct chan_stat* st = &g_chan_stat[i];
+        if (st->loss < HOP_LOSS_MAX) {
+            return i;
+        }
+        if (st->loss < best_loss) {
+            best = i;
+            best_loss = st->loss;
+        }
+        st->loss -= st->loss >> HOP_LOSS_AGE;
+    }
+    return best;
 }
 
-static void x_get_status(void)
+// Start listening data burst on the given hop channel. The radio must be disabled.
+static void hop_start(unsigned i, unsigned requested)
 {
-    uart_put(&g_x_status, 1);
-    uart_tx_flush_binary();
+    g_hop_idx = i;
+    g_hop_confirmed = 0;
+    g_hop_burst = 1;
+    g_hop_requested = requested;
+    g_hop_received = 0;
+    g_hop_ts = rtc_current();
+    rtc_cc_schedule(CC_HOP_TOUT, HOP_CONFIRM_TOUT + 1);
+    radio_set_channel(g_hop_channels[i]);
 }
 
-static void x_get_page(void)
+// The transmitter is heard on the current hop channel
+static inline void hop_confirm(void)
 {
-    x_upd_tout();
-    uart_put(&g_x_status, 1);
-    if (g_x_status == x_reading_data || g_x_status == x_completed)
-    {
-        int b;
-        for (b = 0; b < BUFF_PAGES; ++b)
-        {
-            if (g_buff_status[b] == x_buff_ready)
-            {
-                unsigned pg = g_buff[b].data.h.page_idx;
-                BUG_ON(pg >= DATA_PAGES);
-                BUG_ON(g_pg_status[pg] != x_pg_has_data);
-                g_buff[b].data.h = g_pg_headers[pg];
-                uart_put(&g_buff[b], DATA_PAGE_SZ);
-                g_buff_status[b] = x_buff_unused;
-                break;
-            }
-        }
+    if (g_hop_idx >= 0 && !g_hop_confirmed) {
+        g_hop_confirmed = 1;
+        g_hop_ts = rtc_current();
+        rtc_cc_schedule(CC_HOP_TOUT, HOP_RX_TOUT + 1);
     }
-    uart_tx_flush_binary();
 }
 
-static inline void get_help(void)
+// Account received data fragment
+static inline void hop_got_data(void)
 {
-    uart_printf(" r  - print last report and reception stat" UART_EOL);
-    uart_printf(" u  - get transmitter uptime in seconds" UART_EOL);
-    uart_printf(" s  - start data transfer" UART_EOL);
-    uart_printf(" q  - query data transfer status" UART_EOL);
-    uart_printf(" qd - query data transfer status and data page if available" UART_EOL);
-    uart_printf(" ?  - this help" UART_EOL);
-    uart_tx_flush();
+    hop_confirm();
+    if (g_hop_burst) {
+        ++g_hop_received;
+        g_hop_ts = rtc_current();
+        rtc_cc_schedule(CC_HOP_TOUT, HOP_RX_TOUT + 1);
+    }
 }
 
-void uart_rx_process(void)
+// Data burst is completed, update channel statistic. The channel the
+// transmitter was not heard on is not accounted since the data request
+// was likely lost on the previous one.
+static void hop_burst_end(void)
 {
-    switch (g_uart_rx_buff[0]) {
-    case 'r':
-        get_stat();
-        break;
-    case 'u':
-        get_transmitter_uptime();
-        break;
-    case 's':
-        x_start();
-        break;
-    case 'q':
-        if (g_uart_rx_buff[1] == 'd') {
-            x_get_page();
-        } else {
-            x_get_status();
-        }
-        break;
-    case '?':
-        get_help();
-        break;
-    default:
-        uart_printf("invalid command, send ? to get help" UART_EOL);
-        uart_tx_flush();
+    struct chan_stat* st;
+    unsigned loss = 0;
+    if (!g_hop_burst) {
+        return;
+    }
+    g_hop_burst = 0;
+    if (!g_hop_confirmed) {
+        return;
     }
+    st = &g_chan_stat[g_hop_idx];
+    if (g_hop_received > g_hop_requested) {
+        g_hop_received = g_hop_requested;
+    }
+    if (g_hop_requested) {
+        loss = (g_hop_requested - g_hop_received) * HOP_LOSS_ONE / g_hop_requested;
+    }
+    st->requested += g_hop_requested;
+    st->received  += g_hop_received;
+    st->loss += (loss >> HOP_LOSS_EWMA) - (st->loss >> HOP_LOSS_EWMA);
 }
 
-static inline void pkt_hdr_init(uint8_t type, uint8_t sz)
+// Return to the reports channel
+static void hop_leave(void)
 {
-    g_pkt.hdr.sz      = sz - 1;
-    g_pkt.hdr.version = PROTOCOL_VERSION;
-    g_pkt.hdr.status  = 0;
-    g_pkt.hdr.type    = type;
-    g_pkt.hdr.magic   = PROTOCOL_MAGIC;
+    hop_burst_end();
+    g_hop_idx = -1;
+    rtc_cc_disable(CC_HOP_TOUT);
+    radio_disable_();
+    radio_set_channel(PROTOCOL_CHANNEL);
+    rx_on();
 }
 
-static inline void send_data_request(void)
+static inline int hop_timed_out(void)
 {
+    return g_hop_idx >= 0 && (int)(rtc_current() - g_hop_ts) > (g_hop_confirmed ? HOP_RX_TOUT : HOP_CONFIRM_TOUT);
+}
+
+static void send_data_request(struct x_context* x)
+{
+    unsigned hop = hop_select(x);
     radio_disable_();
-    pkt_hdr_init(packet_data_req, sizeof(struct data_req_packet));
-    memcpy(g_pkt.data_req.fragment_bitmap, g_fragments_required, DATA_PAGES);
+    pkt_hdr_init(packet_data_req, sizeof(struct data_req_packet), x->dev_id);
+    memcpy(g_pkt.data_req.fragment_bitmap, x->fragments_required, DATA_PAGES);
+    g_pkt.data_req.chan = g_hop_channels[hop];
+    radio_set_packet(&g_pkt);
     transmitter_on_();
     radio_transmit_();
     radio_disable_();
-    receiver_on_(0);    
+    hop_start(hop, bits_count(x->fragments_required, DATA_PAGES));
+    rx_on();
 }
 
-static inline void require_pg_headers(void)
+static inline void require_pg_headers(struct x_context* x)
 {
     int i;
-    g_pg_pending = 0;
+    x->pg_meta_pending = 0;
+    x->pg_pending = 0;
     for (i = 0; i < DATA_PAGES; ++i) {
         if (bmap_get_bit(g_pkt.report.page_bitmap, i)) {
-            g_fragments_required[i] = 1;
-            g_pg_status[i] = x_pg_reading_meta;
-            ++g_pg_pending;
+            x->fragments_required[i] = 1;
+            x->pg_status[i] = x_pg_reading_meta;
+            ++x->pg_meta_pending;
         } else {
-            g_fragments_required[i] = 0;
-            g_pg_status[i] = x_pg_unused;
+            x->fragments_required[i] = 0;
+            x->pg_status[i] = x_pg_unused;
         }
     }
 }
 
-static inline void x_request_meta(void)
+static inline void x_request_meta(struct x_context* x)
 {
-    BUG_ON(!g_pg_pending);
-    send_data_request();
+    BUG_ON(!x->pg_meta_pending);
+    send_data_request(x);
 }
 
-static inline void x_start_read_meta(void)
+static inline void x_start_read_meta(struct x_context* x)
 {
-    require_pg_headers();
-    if (g_pg_pending) {
-        x_set_status(x_reading_meta);
-        x_request_meta();
+    require_pg_headers(x);
+    if (x->pg_meta_pending) {
+        x_set_status(x, x_reading_meta);
+        x_request_meta(x);
     } else {
-        x_set_status(x_failed);
+        x_set_status(x, x_failed);
     }
 }
 
-static inline void x_pg_bind_buff(int pg, int b)
+static inline void x_pg_bind_buff(struct x_context* x, int pg, int b)
 {
-    g_pg_buff[pg] = b;
-    g_fragments_required[pg] = ~g_pg_headers[pg].unused_fragments;
-    BUG_ON(!g_fragments_required[pg]);
-    ++g_pg_pending;
-    g_pg_status[pg] = x_pg_reading_data;
+    g_buff_pg[b] = pg;
+    g_buff_crc_errors[b] = 0;
+    g_buff_closed[b] = 0;
+    x->fragments_required[pg] = ~x->pg_unused[pg];
+    BUG_ON(!x->fragments_required[pg]);
+    ++x->pg_pending;
+    x->pg_status[pg] = x_pg_reading_data;
     g_buff_status[b] = x_buff_reading;
+    g_buff_owner[b] = x;
+}
+
+// Bind the page to the buffer if there are enough fragment slots for it
+static inline int x_pg_try_bind(struct x_context* x, int pg, int b)
+{
+    uint8_t used = ~x->pg_unused[pg];
+    if (!x_buff_reserve(b, bits_count(&used, 1))) {
+        return 0;
+    }
+    x_pg_bind_buff(x, pg, b);
+    return 1;
 }
 
-static inline int x_buff_attach(int b)
+// Bind the buffer to the next page. Returns 0 if there are no more pages or
+// not enough fragment slots for the next one.
+static inline int x_buff_attach(struct x_context* x, int b)
 {
     unsigned pg;
-    for (pg = g_pg_next; pg < DATA_PAGES; ++pg) {
-        if (g_pg_status[pg] == x_pg_has_meta) {
-            x_pg_bind_buff(pg, b);
-            g_pg_next = pg + 1;
+    for (pg = x->pg_next; pg < DATA_PAGES; ++pg) {
+        if (x->pg_status[pg] == x_pg_has_meta) {
+            if (!x_pg_try_bind(x, pg, b)) {
+                x->pg_next = pg;
+                return 0;
+            }
+            x->pg_next = pg + 1;
             return 1;
         }
     }
-    g_pg_next = DATA_PAGES;
+    x->pg_next = DATA_PAGES;
     return 0;
 }
 
-static void x_request_data(void)
+// The pages being read are requested first since they hold the buffers. The
+// free buffers are attached to the next pages so they are requested by the
+// same data request. If there are no pages being read while all buffers are
+// waiting for the host the transmitter is left alone till some buffer is
+// released. It drops the connection then and the transfer is resumed on its
+// next report.
+static void x_request_data(struct x_context* x)
 {
-    if (g_pg_next >= DATA_PAGES) {
-        if (!g_pg_pending) {
-            x_set_status(x_completed);
-            return;
-        }
-    } else {
-        int b, has_free_buff = 0;
-        for (b = 0; b < BUFF_PAGES; ++b) {
-            if (g_buff_status[b] == x_buff_unused) {
-                has_free_buff = 1;
-                if (!x_buff_attach(b)) {
-                    break;
-                }
-            }
+    int b;
+    if (x->pg_next >= DATA_PAGES && !x->pg_pending) {
+        x_set_status(x, x_completed);
+        return;
+    }
+    for (b = 0; b < BUFF_PAGES && x->pg_next < DATA_PAGES; ++b) {
+        if (g_buff_status[b] == x_buff_unused && !x_buff_attach(x, b)) {
+            break;
         }
-        if (!has_free_buff) {
-            if ((int)(rtc_current() - g_get_pg_tout_ts) > 0) {
-                x_set_status(x_failed);
-                return;
-            }
+    }
+    if (!x->pg_pending) {
+        if (x->pg_next >= DATA_PAGES) {
+            x_set_status(x, x_completed);
+        } else if ((int)(rtc_current() - x->get_pg_tout_ts) > 0) {
+            x_set_status(x, x_failed);
         }
+        return;
     }
-    send_data_request();
+    send_data_request(x);
 }
 
-static void x_got_report(void)
+static void x_got_report(struct x_context* x)
 {
-    if (g_x_status == x_starting) {
+    if (x->hop_sn != g_pkt.report.sn) {
+        x->hop_sn  = g_pkt.report.sn;
+        x->hop_cnt = 0;
+    }
+    if (x->status == x_starting) {
         if (g_pkt.report.hdr.status & STATUS_LOW_BATT) {
-            x_set_status(x_failed);
+            x_set_status(x, x_failed);
             return;
         }
-        g_x_start_sn = g_pkt.report.sn;
-        x_start_read_meta();
+        x->start_sn = g_pkt.report.sn;
+        x->boot = g_dev[x->dev_id].boot_ts;
+        x_upd_tout(x);
+        x_start_read_meta(x);
         return;
     }
-    if (g_pkt.report.sn < g_x_start_sn) {
-        x_set_status(x_failed);
+    if (g_pkt.report.sn < x->start_sn || x->boot != g_dev[x->dev_id].boot_ts) {
+        x_set_status(x, x_failed);
         return;
     }
-    switch (g_x_status) {
+    switch (x->status) {
     case x_reading_meta:
-        x_request_meta();
+        x_request_meta(x);
         return;
     case x_reading_data:
-        x_request_data();
+        x_request_data(x);
+        return;
+    }
+}
+
+// The pages bound to the buffers in the metadata phase keep being read
+static void x_start_reading_data(struct x_context* x)
+{
+    x->pg_next = 0;
+    x_set_status(x, x_reading_data);
+}
+
+static void x_pg_abort(struct x_context* x, int pg, int b)
+{
+    x->fragments_required[pg] = 0;
+    BUG_ON(!x->pg_pending);
+    --x->pg_pending;
+    x->pg_status[pg] = x_pg_aborted;
+    x_buff_free(b);
+}
+
+// Verify the page CRC once all fragments are received
+static void x_pg_completed(struct x_context* x, int pg, int b)
+{
+    if (g_buff_crc[b] != x_buff_items_crc(b)) {
+        // The page might be updated while being read so request all fragments
+        // used according to the header received
+        struct data_page_hdr const* h = (struct data_page_hdr const*)x_buff_frag(b, 0);
+        uint8_t used = ~h->unused_fragments;
+        if (++g_buff_crc_errors[b] > X_CRC_RETRIES || !x_buff_reserve(b, bits_count(&used, 1))) {
+            x_pg_abort(x, pg, b);
+            return;
+        }
+        // The header is output with the page so it should match the fragments
+        x_pg_set_hdr(x, pg, h);
+        x->fragments_required[pg] = used;
+        return;
+    }
+    BUG_ON(!x->pg_pending);
+    --x->pg_pending;
+    x->pg_status[pg] = x_pg_has_data;
+    if (!x->sync) {
+        g_buff_status[b] = x_buff_ready;
+    } else if (g_buff_closed[b]) {
+        g_buff_status[b] = x_buff_caching;
+    } else {
+        // Nobody is going to read it
+        x_buff_free(b);
+    }
+}
+
+// Store the data fragment of the page being read
+static void x_got_fragment(struct x_context* x, unsigned pg, unsigned f)
+{
+    int b = x_pg_buff(x, pg);
+    unsigned fragment_bit = 1 << f;
+    BUG_ON(b < 0);
+    if (!(x->fragments_required[pg] & fragment_bit)) {
+        return;
+    }
+    if (x->pg_sn[pg] != g_pkt.data.pg_hdr.sn) {
+        x_pg_abort(x, pg, b);
         return;
     }
+    x_buff_put_frag(b, f, &g_pkt.data.fragment);
+    if (f == DATA_PG_FRAGMENTS - 1) {
+        // The transmitter stores CRC in the page once it is completed
+        g_buff_closed[b] = !memcmp(x_buff_frag(b, f) + DATA_FRAG_SZ - DATA_PAGE_CRC_SZ,
+                                    &g_pkt.data.pg_crc, DATA_PAGE_CRC_SZ);
+    }
+    g_buff_crc[b] = g_pkt.data.pg_crc;
+    x->fragments_required[pg] &= ~fragment_bit;
+    if (!x->fragments_required[pg]) {
+        x_pg_completed(x, pg, b);
+    }
 }
 
-static void x_start_reading_data(void)
+// The header comes with the first page fragment. If there is free buffer the
+// page reading starts right away so the fragment is not requested again.
+static void x_got_meta(struct x_context* x, unsigned pg, unsigned f)
 {
-    g_pg_next = 0;
-    memset(g_buff_status, 0, sizeof(g_buff_status));
-    x_set_status(x_reading_data);
+    int b;
+    x->fragments_required[pg] = 0;
+    x_pg_set_hdr(x, pg, &g_pkt.data.pg_hdr);
+    BUG_ON(!x->pg_meta_pending);
+    --x->pg_meta_pending;
+    if (page_cache_find(x->dev_id, x->boot, pg, g_pkt.data.pg_hdr.sn)) {
+        x->pg_status[pg] = x->sync ? x_pg_has_data : x_pg_cached;
+        return;
+    }
+    if (x->sync) {
+        if (x->sync_pages >= PAGE_CACHE_PAGES || !page_cache_is_new(x->dev_id, x->boot, &g_pkt.data.pg_hdr)) {
+            // Not going to be cached
+            x->pg_status[pg] = x_pg_has_data;
+            return;
+        }
+        ++x->sync_pages;
+    }
+    x->pg_status[pg] = x_pg_has_meta;
+    if (f) {
+        return;
+    }
+    for (b = 0; b < BUFF_PAGES; ++b) {
+        if (g_buff_status[b] == x_buff_unused) {
+            if (x_pg_try_bind(x, pg, b)) {
+                x_got_fragment(x, pg, f);
+            }
+            return;
+        }
+    }
 }
 
-static void x_got_data(void)
+static void x_got_data(struct x_context* x)
 {
     unsigned pg = g_pkt.data.pg_hdr.page_idx;
     unsigned f  = g_pkt.data.pg_hdr.fragment_;
     if (pg >= DATA_PAGES || f >= DATA_PG_FRAGMENTS) {
-        x_set_status(x_failed);
+        x_set_status(x, x_failed);
         return;
     }
-    switch (g_x_status) {
+    switch (x->status) {
     case x_reading_meta:
-        if (g_pg_status[pg] == x_pg_reading_meta)
-        {
-            g_fragments_required[pg] = 0;
-            g_pg_headers[pg] = g_pkt.data.pg_hdr;
-            g_pg_status[pg] = x_pg_has_meta;
-            BUG_ON(!g_pg_pending);
-            if (!--g_pg_pending) {
-                x_start_reading_data();
+        if (x->pg_status[pg] == x_pg_reading_meta) {
+            x_got_meta(x, pg, f);
+            if (!x->pg_meta_pending) {
+                x_start_reading_data(x);
             }
+            break;
         }
-        break;
+        // The pages bound in the metadata phase are being read as well
     case x_reading_data:
-        if (g_pg_status[pg] == x_pg_reading_data)
-        {
-            int b = g_pg_buff[pg];
-            unsigned fragment_bit = 1 << f;
-            BUG_ON(g_buff_status[b] != x_buff_reading);
-            if (g_fragments_required[pg] & fragment_bit) {
-                if (g_pg_headers[pg].sn != g_pkt.data.pg_hdr.sn) {
-                    g_fragments_required[pg] = 0;
-                    BUG_ON(!g_pg_pending);
-                    --g_pg_pending;
-                    g_pg_status[pg]  = x_pg_aborted;
-                    g_buff_status[b] = x_buff_unused;
-                    return;
-                }
-                memcpy(&g_buff[b].fragment[f], &g_pkt.data.fragment, DATA_FRAG_SZ);
-                g_fragments_required[pg] &= ~fragment_bit;
-                if (!g_fragments_required[pg]) {
-                    BUG_ON(!g_pg_pending);
-                    --g_pg_pending;
-                    g_pg_status[pg]  = x_pg_has_data;
-                    g_buff_status[b] = x_buff_ready;
-                }
-            }
+        if (x->pg_status[pg] == x_pg_reading_data) {
+            x_got_fragment(x, pg, f);
         }
         break;
     }
 }
 
+// Write the next page completed to the cache. The flash operations stall the
+// CPU so it is done between data bursts.
+static void x_cache_flush(void)
+{
+    int b;
+    if (g_hop_idx >= 0) {
+        return;
+    }
+    for (b = 0; b < BUFF_PAGES; ++b) {
+        if (g_buff_status[b] == x_buff_caching) {
+            struct x_context* x = g_buff_owner[b];
+            void const* fragments[DATA_PG_FRAGMENTS];
+            struct data_page_hdr h;
+            unsigned f;
+            for (f = 0; f < DATA_PG_FRAGMENTS; ++f) {
+                fragments[f] = x_buff_frag(b, f);
+            }
+            x_pg_get_hdr(x, g_buff_pg[b], &h);
+            page_cache_put(x->dev_id, x->boot, &h, fragments, g_buff_crc[b]);
+            x_buff_free(b);
+            if (x->sync) {
+                // Nobody reads the buffers so the free one is the progress
+                x_upd_tout(x);
+            }
+            return;
+        }
+    }
+}
+
+// The autonomous transfer should not interfere with the host
+static int x_sync_allowed(void)
+{
+    int i;
+    if (g_x_stream_dev >= 0) {
+        return 0;
+    }
+    for (i = 0; i < BUFF_PAGES; ++i) {
+        if (g_buff_status[i] != x_buff_unused) {
+            return 0;
+        }
+    }
+    for (i = 0; i < X_CONTEXTS; ++i) {
+        struct x_context* x = &g_x_ctx[i];
+        if (x_is_active(x) || (!x->sync && x_page_ready(x))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Start autonomous transfer on the report received if it is time to do so
+static void x_sync(unsigned dev_id)
+{
+    struct device* dev = &g_dev[dev_id];
+    struct x_context* x;
+    if (g_pkt.report.sn - dev->sync_sn < X_SYNC_PERIOD / dev_measuring_period(dev) || !x_sync_allowed()) {
+        return;
+    }
+    if (!(x = x_get_context(dev_id))) {
+        return;
+    }
+    dev->sync_sn = g_pkt.report.sn;
+    x_release_buffers(x);
+    x_upd_start_tout(x);
+    x->sync = 1;
+    x->sync_pages = 0;
+    page_cache_new_pass();
+    x_set_status(x, x_starting);
+}
+
 #ifdef USE_DISPLAY
 #define BUFF_SZ 16
-static void show_new_sample(void)
+static void show_new_sample(struct device const* dev)
 {
-    float pw = PW_SCALE * g_last_report.power;
-    float vb = VCC_SCALE * g_last_report.vbatt;
+    float pw = PW_SCALE * dev->last_report.power;
+    float vb = VCC_SCALE * dev->last_report.vbatt;
     char pw_buff[BUFF_SZ+1] = {0}, vb_buff[BUFF_SZ+1] = {0};
 
     snprintf(pw_buff, BUFF_SZ, pw < 100 ? "%.1f" : "%.0f", pw);
@@ -456,41 +1782,253 @@ static void show_new_sample(void)
     glcd_print_str_r(DISP_W, 2, pw_buff, &g_font_Tahoma44x47D, 1);
 }
 #else
-static void show_new_sample(void) {}
+static void show_new_sample(struct device const* dev) {}
 #endif
 
-static void on_new_sample(void)
+// The transmitter restart is detected by the report sequence number going
+// backwards or by the start time estimated from it moving ahead more than the
+// clocks drift and the report delay may explain. The restart may be missed
+// while the transmitter is out of reach otherwise.
+#define BOOT_DRIFT_DIV 4096 // ~250ppm
+
+static void dev_check_boot(struct device* dev)
+{
+    unsigned period = dev_measuring_period(dev);
+    unsigned uptime = g_pkt.report.sn * period;
+    uint32_t boot = g_pkt_ts - uptime * RTC_HZ;
+    if (dev->report_packets && g_pkt.report.sn >= dev->last_report.sn &&
+        (int)(boot - dev->boot_ts) <= (int)((2 * period + uptime / BOOT_DRIFT_DIV) * RTC_HZ)
+    ) {
+        return;
+    }
+    dev->boot_ts = boot;
+    page_cache_set_boot(dev - g_dev, boot, g_pkt.report.sn);
+}
+
+static void on_new_sample(struct device* dev)
 {
-    g_last_report    = g_pkt.report;
-    g_last_report_ts = rtc_current();
-    ++g_report_packets;
-    show_new_sample();
+    dev_check_boot(dev);
+    dev->last_report    = g_pkt.report;
+    dev->last_report_ts = g_pkt_ts;
+    dev->layout_wait    = (g_pkt.hdr.status & STATUS_LAYOUT) != 0;
+    ++dev->report_packets;
+    if (dev == &g_dev[DISPLAY_DEV_ID]) {
+        show_new_sample(dev);
+    }
 }
 
-static void on_packet_received(void)
+static void on_packet_received(int crc_ok)
 {
     ++g_total_packets;
-    if (receive_crc_ok() && pkt_hdr_valid())
+    if (crc_ok && pkt_hdr_valid())
     {
+        struct device* dev = &g_dev[g_pkt.hdr.dev_id];
+        struct x_context* x = dev->x;
         ++g_good_packets;
+        ++dev->good_packets;
         switch (g_pkt.hdr.type) {
         case packet_report:
+            hop_confirm();
+            hop_burst_end();
             if (g_pkt.hdr.status & STATUS_NEW_SAMPLE) {
-                on_new_sample();
+                on_new_sample(dev);
             }
-            if (x_is_active()) {
-                x_got_report();
+            if (!x || !x_is_active(x)) {
+                x_sync(g_pkt.hdr.dev_id);
+                x = dev->x;
+            }
+            if (x && x_is_active(x)) {
+                x_got_report(x);
+            }
+            if (g_hop_idx >= 0 && !g_hop_burst) {
+                // Data request was not sent so the connection is closed
+                hop_leave();
             }
             break;
         case packet_data:
-            if (x_is_active()) {
-                x_got_data();
+            hop_got_data();
+            if (x && x_is_active(x)) {
+                x_got_data(x);
             }
             break;
+        case packet_layout:
+            layout_put(&g_pkt.layout);
+            dev->measuring_period = g_pkt.layout.measuring_period;
+            dev->layout_wait = 0;
+            break;
+        }
+    }
+}
+
+// Process the packet received to the oldest slot
+static void rx_process(void)
+{
+    unsigned slot = g_rx_tail % RX_SLOTS;
+    int crc_ok = g_rx_crc_ok[slot];
+    BUG_ON(g_rx_tail == g_rx_head);
+    memcpy(&g_pkt, &g_rx_slots[slot], sizeof(g_pkt));
+    g_pkt_ts = g_rx_ts[slot];
+    ++g_rx_tail;
+    if (g_rx_stalled) {
+        // The slot is free now so receiving may be resumed
+        g_rx_stalled = 0;
+        rx_next();
+    }
+    on_packet_received(crc_ok);
+}
+
+//---- duty cycling --------------------------
+
+#ifdef RX_DUTY_CYCLE
+
+// The receiver is powered only around the time the next report is expected
+// from every known transmitter. The transmitters report once per measuring
+// period so the schedule is learned from the last report reception time.
+// The guard interval is doubled on every missed report to compensate clock
+// drift. The transmitter is considered lost after RX_MISSES_MAX misses.
+// The whole period is listened once per RX_SCAN_PERIODS periods to find
+// new transmitters as well as the lost ones. The scan is more frequent while
+// there are no transmitters being tracked. The transmitter period is taken
+// from its layout once received. The receiver keeps listening for a while
+// after the report announcing the layout packet.
+
+#define RX_PERIOD       (MEASURING_PERIOD*RTC_HZ)
+#define RX_GUARD_MIN    (RTC_HZ/32) // ~30 msec
+#define RX_LAYOUT_WAIT  (RTC_HZ/64) // ~15 msec
+#define RX_MISSES_MAX   8
+#define RX_SCAN_PERIODS 32
+#define RX_SCAN_PERIODS_UNSYNC 4
+
+static int      g_rx_enabled = 1;
+static unsigned g_rx_scan_ts; // the next scan start time
+
+// Returns non zero and the receive window bounds if the next report from the given
+// transmitter is expected. The window may start in the past.
+static int rx_report_window(struct device const* dev, unsigned now, unsigned* start, unsigned* end)
+{
+    unsigned misses, period;
+    if (!dev->report_packets) {
+        return 0;
+    }
+    if (dev->layout_wait && (int)(dev->last_report_ts + RX_LAYOUT_WAIT - now) > 0) {
+        *start = dev->last_report_ts;
+        *end   = dev->last_report_ts + RX_LAYOUT_WAIT;
+        return 1;
+    }
+    period = dev_measuring_period(dev) * RTC_HZ;
+    for (misses = 0; misses <= RX_MISSES_MAX; ++misses) {
+        unsigned expected = dev->last_report_ts + (misses + 1) * period;
+        unsigned guard = RX_GUARD_MIN << misses;
+        if (guard > period / 4) {
+            guard = period / 4;
+        }
+        if ((int)(expected + guard - now) > 0) {
+            *start = expected - guard;
+            *end   = expected + guard;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int rx_busy(void)
+{
+    int i;
+    if (g_hop_idx >= 0) {
+        return 1;
+    }
+    for (i = 0; i < X_CONTEXTS; ++i) {
+        if (x_is_active(&g_x_ctx[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void rx_enable(void)
+{
+    if (!g_rx_enabled) {
+        hf_osc_start();
+        rx_on();
+        g_rx_enabled = 1;
+    }
+}
+
+// The stall flag is cleared as well so rx_process() does not resume reception
+// with the HF oscillator stopped. The reception is restarted by rx_on().
+static void rx_disable(void)
+{
+    if (g_rx_enabled) {
+        radio_disable_();
+        g_rx_stalled = 0;
+        hf_osc_stop();
+        g_rx_enabled = 0;
+    }
+}
+
+// Turn receiver on or off and schedule the wake up on the next receive window boundary
+static void rx_schedule(void)
+{
+    unsigned now = rtc_current(), next, start, end;
+    int d, listen = 0, synced = 0;
+
+    if (rx_busy()) {
+        // Data transfer is in progress, we will be called again on its completion.
+        // Wake up anyway to check the transfer start timeout.
+        rx_enable();
+        rtc_cc_schedule(CC_RX_WINDOW, RX_PERIOD);
+        return;
+    }
+    next = now + RX_PERIOD;
+    for (d = 0; d < MAX_DEVICES; ++d) {
+        unsigned t;
+        if (!rx_report_window(&g_dev[d], now, &start, &end)) {
+            continue;
+        }
+        synced = 1;
+        if ((int)(now - start) >= 0) {
+            listen = 1;
+            t = end;
+        } else {
+            t = start;
+        }
+        if ((int)(t - next) < 0) {
+            next = t;
+        }
+    }
+    if ((int)(now - g_rx_scan_ts) >= RX_PERIOD) {
+        g_rx_scan_ts = now + ((synced ? RX_SCAN_PERIODS : RX_SCAN_PERIODS_UNSYNC) - 1) * RX_PERIOD;
+    }
+    if ((int)(now - g_rx_scan_ts) >= 0) {
+        listen = 1;
+        if ((int)(g_rx_scan_ts + RX_PERIOD - next) < 0) {
+            next = g_rx_scan_ts + RX_PERIOD;
         }
+    } else if ((int)(g_rx_scan_ts - next) < 0) {
+        next = g_rx_scan_ts;
+    }
+    if (listen) {
+        rx_enable();
+    } else {
+        rx_disable();
     }
+    // The compare event is missed if set to the current or the next counter value
+    if ((int)(next - now) < 2) {
+        next = now + 2;
+    }
+    rtc_cc_set(CC_RX_WINDOW, next);
+}
+
+#else
+
+static inline void rx_schedule(void)
+{
+    // Wake up periodically anyway so rtc_current() tracks the counter overflow
+    rtc_cc_schedule(CC_RX_WINDOW, MEASURING_PERIOD*RTC_HZ);
 }
 
+#endif
+
 #ifdef USE_DISPLAY
 static void show_startup_screen(void)
 {
@@ -519,7 +2057,7 @@ static void show_startup_screen(void)
  */
 int main(void)
 {
-    rtc_initialize(rtc_dummy_handler);
+    rtc_initialize(rtc_handler);
     radio_configure(&g_pkt, 0, PROTOCOL_CHANNEL);
     uart_init();
     hf_osc_start();
@@ -529,15 +2067,51 @@ int main(void)
     show_startup_screen();
 #endif
 
-    receiver_on_(0);
-    receive_start();
+    page_cache_init();
+    x_buff_init();
+
+    rx_on();
+    rx_schedule();
 
     while (true)
     {
-        if (radio_tx_end()) {
-            on_packet_received();
-            receive_start();
+        evt_t evt;
+        if (!evt_get(&evt)) {
+            wait_events();
+            continue;
+        }
+        switch (evt) {
+        case evt_packet:
+            rx_process();
+            break;
+        case evt_uart_cmd:
+            g_uart_cmd_evt = 0;
+            break;
+        case evt_hop_tout:
+            if (hop_timed_out()) {
+                hop_leave();
+            }
+            break;
+        case evt_uart_tx:
+            g_uart_tx_evt = 0;
+            break;
+        case evt_rx_window:
+            break;
+        case evt_baud_tout:
+            if (g_baud_state == baud_verifying) {
+                baud_restore();
+            }
+            break;
+        }
+        uart_cmd_process();
+        x_cache_flush();
+        x_check_start_tout();
+        baud_switch();
+        if (g_baud_state == baud_idle) {
+            // The output is held till the baud rate switch is completed
+            x_stream_push();
         }
+        rx_schedule();
     }
 }
 
@@ -12,6 +12,7 @@
 #include "bug.h"
 #include "bmap.h"
 #include "radio.h"
+#include "crc32.h"
 
 #include <math.h>
 #include <stdint.h>
@@ -88,6 +89,14 @@ static double g_cos[SAMPLE_COUNT];
 // The multiplier to correct readings
 #define AMPL_CALIB 1.10
 
+// The energy is accumulated as the sum of the power readings. Every reading
+// accounts for the measuring period so 1 Wh is the sum of 3600/MEASURING_PERIOD
+// readings of 1W which is 5 units.
+#define ENERGY_WH_UNITS (3600*5/MEASURING_PERIOD)
+
+static uint32_t g_energy_wh;
+static uint32_t g_energy_units; // the remainder less than 1 Wh
+
 #pragma data_alignment=DATA_PAGE_SZ
 static const struct data_page g_hist_pages[DATA_PAGES];
 
@@ -96,39 +105,43 @@ static uint8_t g_page_bmap[DATA_PG_BITMAP_SZ];
 
 static struct data_history g_history[dom_count];
 
-static const struct data_history_param g_hist_params[dom_count] = {
-    {
-        .storage = {
-            .buff = g_hist_pages,
-            .pmap = g_page_bmap,
-            .pfirst = 0,
-            .npages = FAST_PW_PAGES,
-            .domain = dom_fast_pw
-        },
-        .item_samples = FAST_PW_PERIOD / MEASURING_PERIOD,
+// The history parameters are given by the domains description, see domains.h.
+// The histories are cascaded: the one fed by the buckets completed by the other
+// is linked to it on initialization. So the coarser tier costs the description
+// entry and the work per finer bucket only.
+#define DOMAIN_HIST_PARAM_(id, name, pages, period, input, values, scale) \
+    {                                                                     \
+        .storage = {                                                      \
+            .buff = g_hist_pages,                                         \
+            .pmap = g_page_bmap,                                          \
+            .pfirst = DOM_PFIRST(id),                                     \
+            .npages = DOM_PAGES(id),                                      \
+            .domain = dom_##id                                            \
+        },                                                                \
+        .item_samples = (period) / DOM_INPUT_PERIOD(id),                  \
+        .min_max = (values) > 1,                                          \
     },
-    {
-        .storage = {
-            .buff = g_hist_pages,
-            .pmap = g_page_bmap,
-            .pfirst = FAST_PW_PAGES,
-            .npages = SLOW_PW_PAGES,
-            .domain = dom_slow_pw
-        },
-        .item_samples = SLOW_PW_PERIOD / MEASURING_PERIOD,
-    },
-    {
-        .storage = {
-            .buff = g_hist_pages,
-            .pmap = g_page_bmap,
-            .pfirst = FAST_PW_PAGES + SLOW_PW_PAGES,
-            .npages = VBATT_PAGES,
-            .domain = dom_vbatt
-        },
-        .item_samples = VBATT_PERIOD / MEASURING_PERIOD,
-    }
+
+static const struct data_history_param g_hist_params[dom_count] = {
+    DATA_DOMAINS(DOMAIN_HIST_PARAM_)
+};
+
+#define DOMAIN_INPUT_(id, name, pages, period, input, values, scale) DOM_INPUT(id),
+
+static const uint8_t g_hist_input[dom_count] = {
+    DATA_DOMAINS(DOMAIN_INPUT_)
+};
+
+// The domains description advertised by the layout packet
+#define DOMAIN_LAYOUT_(id, name, pages, period, input, values, scale) \
+    {(period), (scale), DOM_PFIRST(id), DOM_PAGES(id), DOM_INPUT(id), (values)},
+
+static const struct domain_layout g_domain_layout[dom_count] = {
+    DATA_DOMAINS(DOMAIN_LAYOUT_)
 };
 
+BUILD_BUG_ON(dom_count > MAX_DOMAINS);
+
 //------ System status & communications -------------------
 
 // Threshold voltages
@@ -145,13 +158,26 @@ static const struct data_history_param g_hist_params[dom_count] = {
 
 #define RX_RETRY_CNT 4
 
+// The layout packet follows every LAYOUT_REPORTS-th report starting from the first one.
+// It is not sent if the data request follows the report so it stays due then.
+#define LAYOUT_REPORTS 32
+
+// Transmitter identifier, should be unique for every transmitter served by the same receiver
+#ifndef DEVICE_ID
+#define DEVICE_ID 0
+#endif
+
+BUILD_BUG_ON(DEVICE_ID >= MAX_DEVICES);
+
 static uint8_t g_batt_status;
+static unsigned g_layout_skip; // reports to send before the next layout
 
 static union {
     struct packet_hdr      hdr;
     struct report_packet   report;
     struct data_req_packet data_req;
     struct data_packet     data;
+    struct layout_packet   layout;
 } g_pkt;
 
 static int g_addr_received;
@@ -168,24 +194,45 @@ static inline void pkt_hdr_init(uint8_t type, uint8_t sz)
     g_pkt.hdr.version = PROTOCOL_VERSION;
     g_pkt.hdr.status  = g_batt_status;
     g_pkt.hdr.type    = type;
+    g_pkt.hdr.dev_id  = DEVICE_ID;
     g_pkt.hdr.magic   = PROTOCOL_MAGIC;
 }
 
-static void send_report(int new_sample)
+static void send_report(uint8_t status)
 {
     pkt_hdr_init(packet_report, sizeof(struct report_packet));
-    if (new_sample) {
-        g_pkt.hdr.status |= STATUS_NEW_SAMPLE;
-    }
-    g_pkt.report.power = g_amplitude;
-    g_pkt.report.vbatt = g_vbatt_dmv;
-    g_pkt.report.sn    = g_data_sn;
+    g_pkt.hdr.status |= status;
+    g_pkt.report.power  = g_amplitude;
+    g_pkt.report.vbatt  = g_vbatt_dmv;
+    g_pkt.report.energy = g_energy_wh;
+    g_pkt.report.sn     = g_data_sn;
     memcpy(&g_pkt.report.page_bitmap, g_page_bmap, sizeof(g_page_bmap));
     transmitter_on_();
     radio_transmit_();
     radio_disable_();
 }
 
+// Returns non zero if the layout should follow the next report
+static inline int layout_due(void)
+{
+    return !g_layout_skip;
+}
+
+static void send_layout(void)
+{
+    pkt_hdr_init(packet_layout, sizeof(struct layout_packet));
+    g_pkt.layout.measuring_period = MEASURING_PERIOD;
+    g_pkt.layout.domains  = dom_count;
+    g_pkt.layout.features = FEATURE_ENERGY | FEATURE_MIN_MAX | FEATURE_LAYOUT_CRC;
+    memset(g_pkt.layout.domain, 0, sizeof(g_pkt.layout.domain));
+    memcpy(g_pkt.layout.domain, g_domain_layout, sizeof(g_domain_layout));
+    g_pkt.layout.crc = crc32((uint8_t const*)&g_pkt.layout, LAYOUT_CRC_SZ);
+    transmitter_on_();
+    radio_transmit_();
+    radio_disable_();
+    g_layout_skip = LAYOUT_REPORTS - 1;
+}
+
 static void upd_batt_status(uint16_t dmv)
 {
     unsigned s = 0;
@@ -217,7 +264,9 @@ static void data_req_cb(void)
         g_pkt.hdr.version == PROTOCOL_VERSION &&
         g_pkt.hdr.magic   == PROTOCOL_MAGIC   &&
         g_pkt.hdr.type    == packet_data_req  &&
-        g_pkt.hdr.sz      == sizeof(struct data_req_packet) - 1
+        g_pkt.hdr.dev_id  == DEVICE_ID        &&
+        g_pkt.hdr.sz      == sizeof(struct data_req_packet) - 1 &&
+        g_pkt.data_req.chan <= MAX_CHANNEL
     ) {
         memcpy(&g_data_req_packet, &g_pkt.data_req, sizeof(g_data_req_packet));
         g_data_req_received = 1;
@@ -237,12 +286,26 @@ static int receive_data_request(unsigned tout)
     radio_disable_();
     if (g_data_req_received) {
         g_data_req_received = 0;
+        // Switch to the channel requested by receiver
+        radio_set_channel(g_data_req_packet.chan);
         return 1;
     } else {
         return 0;
     }
 }
 
+static uint32_t hist_page_crc(struct data_page const* pg)
+{
+    int d;
+    for (d = 0; d < dom_count; ++d) {
+        if (data_log_owns_pg(&g_history[d].storage, pg)) {
+            return data_log_pg_crc(&g_history[d].storage, pg);
+        }
+    }
+    BUG();
+    return 0;
+}
+
 static int send_next_data_(void)
 {
     int i, f;
@@ -268,6 +331,7 @@ static int send_next_data_(void)
                     memcpy(&g_pkt.data.pg_hdr, &pg->data.h, sizeof(pg->data.h));
                     BUG_ON(g_pkt.data.pg_hdr.page_idx != i);
                     g_pkt.data.pg_hdr.fragment_ = f;
+                    g_pkt.data.pg_crc = hist_page_crc(&pg->data);
                     memcpy(&g_pkt.data.fragment, &pg->fragment[f], DATA_FRAG_SZ);
                     radio_transmit_();
                     // Fragment sent - clear corresponding bit in request
@@ -448,6 +512,12 @@ static void init_history(void)
     for (d = 0; d < dom_count; ++d) {
         data_hist_initialize(&g_history[d], &g_hist_params[d]);
     }
+    for (d = 0; d < dom_count; ++d) {
+        if (g_hist_input[d] != d) {
+            BUG_ON(g_history[g_hist_input[d]].next);
+            g_history[g_hist_input[d]].next = &g_history[d];
+        }
+    }
 }
 
 static void history_suspend(void)
@@ -458,11 +528,38 @@ static void history_suspend(void)
     }
 }
 
+// The power is not measured in hibernate mode so it is not accounted
+static void energy_update(void)
+{
+    g_energy_units += g_amplitude;
+    if (g_energy_units >= ENERGY_WH_UNITS) {
+        g_energy_wh += g_energy_units / ENERGY_WH_UNITS;
+        g_energy_units %= ENERGY_WH_UNITS;
+    }
+}
+
+// The sample feeding the domain which has own id as input
+static uint16_t history_sample(int d)
+{
+    switch (d) {
+    case dom_fast_pw: return g_amplitude;
+    case dom_vbatt:   return g_vbatt_dmv;
+    default:
+        BUG();
+        return 0;
+    }
+}
+
+// The domains fed by samples are the ones having own id as input, the rest
+// are fed by their input domain buckets
 static void history_update(void)
 {
-    data_hist_put_sample(&g_history[dom_fast_pw], g_amplitude, g_data_sn);
-    data_hist_put_sample(&g_history[dom_slow_pw], g_amplitude, g_data_sn);
-    data_hist_put_sample(&g_history[dom_vbatt],   g_vbatt_dmv, g_data_sn);
+    int d;
+    for (d = 0; d < dom_count; ++d) {
+        if (g_hist_input[d] == d) {
+            data_hist_put_sample(&g_history[d], history_sample(d), g_data_sn);
+        }
+    }
 }
 
 static int connection_loop(void)
@@ -479,16 +576,25 @@ static int connection_loop(void)
         if (g_evt.any) {
             return 1;
         }
-        for (i = 0; i < RX_RETRY_CNT; ++i)
+        for (i = 0; i < 2 * RX_RETRY_CNT; ++i)
         {
+            if (i == RX_RETRY_CNT) {
+                // The receiver returns to the reports channel if it has not
+                // heard the data burst since the data request was lost
+                radio_set_channel(PROTOCOL_CHANNEL);
+            }
             send_report(0);
             data_req = receive_data_request(RX_ADDR_TOUT_TICKS_CONN);
             if (data_req) {
                 break;
             }
         }
-        if (!data_req || g_evt.any) {
-            return data_req;
+        if (!data_req) {
+            // Connection lost, staying on the reports channel
+            return 0;
+        }
+        if (g_evt.any) {
+            return 1;
         }
     }
 }
@@ -548,18 +654,25 @@ int main(void)
                 BUG_ON(g_batt_status & STATUS_HIBERNATE);
                 hibernate = 0;
                 process_data();
+                energy_update();
                 history_update();
                 if (connected) {
                     continue;
                 }
                 if (!(g_batt_status & STATUS_SILENT)) {
-                    send_report(1);
+                    int layout = layout_due();
+                    send_report(layout ? STATUS_NEW_SAMPLE | STATUS_LAYOUT : STATUS_NEW_SAMPLE);
                     if (!(g_batt_status & STATUS_LOW_BATT)) {
                         if (receive_data_request(RX_ADDR_TOUT_TICKS)) {
                             connected = 1;
                             continue;
                         }
                     }
+                    if (layout) {
+                        send_layout();
+                    } else {
+                        --g_layout_skip;
+                    }
                 }
             } else {
                 BUG_ON(!(g_batt_status & STATUS_HIBERNATE));
@@ -567,6 +680,7 @@ int main(void)
                     history_suspend();
                     hibernate = 1;
                     connected = 0;
+                    radio_set_channel(PROTOCOL_CHANNEL);
                 }
             }
             hf_osc_stop();
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "node.h"
+
+#include <stdint.h>
+
+typedef uint32_t ret_code_t;
+
+#define NRF_SUCCESS 0
+
+#define APP_ERROR_CHECK(err) do { \
+        if ((err) != NRF_SUCCESS) \
+            sim_fatal(__FILE__, __LINE__, "error " #err); \
+    } while (0)
@@ -0,0 +1,7 @@
+#pragma once
+
+#define APP_IRQ_PRIORITY_HIGH 1
+#define APP_IRQ_PRIORITY_LOW  3
+
+#define CRITICAL_REGION_ENTER() {
+#define CRITICAL_REGION_EXIT()  }
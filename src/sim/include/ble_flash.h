@@ -0,0 +1,12 @@
+#pragma once
+
+//
+// Simulator stand-in for ble_flash.h. The flash is the memory section
+// the history pages are placed to (see Makefile).
+//
+
+#include <stdint.h>
+
+uint32_t ble_flash_page_erase(unsigned page_num);
+uint32_t ble_flash_word_write(uint32_t* p_address, uint32_t value);
+uint32_t ble_flash_block_write(uint32_t* p_address, uint32_t* p_in_array, uint16_t word_count);
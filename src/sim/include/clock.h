@@ -0,0 +1,26 @@
+#pragma once
+
+//
+// Simulator stand-in for clock.h. Only tracks the crystal oscillator state.
+//
+
+extern int g_sim_hf_osc;
+
+static inline int hf_osc_active(void)
+{
+    return g_sim_hf_osc;
+}
+
+static inline void hf_osc_start(void)
+{
+    g_sim_hf_osc = 1;
+}
+
+static inline void hf_osc_stop(void)
+{
+    g_sim_hf_osc = 0;
+}
+
+static inline void lf_osc_start(void)
+{
+}
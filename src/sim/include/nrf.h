@@ -0,0 +1,25 @@
+#pragma once
+
+//
+// Simulator stand-in for the device header. Interrupts are delivered by the
+// simulator only while the node is waiting so masking them is no-op.
+// Enabling them is the point where busy waiting loops let the time run.
+//
+
+#include "node.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define __disable_interrupt() do {} while (0)
+#define __enable_interrupt()  sim_irq_enable()
+#define __disable_irq()       do {} while (0)
+#define __enable_irq()        sim_irq_enable()
+#define __WFI()               sim_wait_event()
+#define __WFE()               sim_wait_event()
+#define __SEV()               do {} while (0)
+#define __NOP()               do {} while (0)
+
+#define __STATIC_INLINE static inline
+#define __INLINE        inline
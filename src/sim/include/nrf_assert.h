@@ -0,0 +1,8 @@
+#pragma once
+
+#include "node.h"
+
+#define ASSERT(expr) do { \
+        if (!(expr)) \
+            sim_fatal(__FILE__, __LINE__, #expr); \
+    } while (0)
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "node.h"
+
+static inline void nrf_delay_us(uint32_t us)
+{
+    sim_sleep(us);
+}
+
+static inline void nrf_delay_ms(uint32_t ms)
+{
+    sim_sleep(1000 * (uint64_t)ms);
+}
@@ -0,0 +1,3 @@
+#pragma once
+
+// The ADC is simulated at the ads1220.h interface level
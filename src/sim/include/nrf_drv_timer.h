@@ -0,0 +1,46 @@
+#pragma once
+
+//
+// Simulator stand-in for the 1MHz TIMER driver.
+//
+
+#include "app_error.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SIM_TIMER_CC 4
+
+typedef enum {
+    NRF_TIMER_CC_CHANNEL0,
+    NRF_TIMER_CC_CHANNEL1,
+    NRF_TIMER_CC_CHANNEL2,
+    NRF_TIMER_CC_CHANNEL3,
+} nrf_timer_cc_channel_t;
+
+typedef enum {
+    NRF_TIMER_EVENT_COMPARE0,
+    NRF_TIMER_EVENT_COMPARE1,
+    NRF_TIMER_EVENT_COMPARE2,
+    NRF_TIMER_EVENT_COMPARE3,
+} nrf_timer_event_t;
+
+typedef void (*nrf_timer_event_handler_t)(nrf_timer_event_t event_type, void* p_context);
+
+struct sim_timer_regs;
+
+typedef struct {
+    struct sim_timer_regs* p_reg;
+} nrf_drv_timer_t;
+
+extern struct sim_timer_regs g_sim_timer0;
+
+#define NRF_DRV_TIMER_INSTANCE(id) { .p_reg = &g_sim_timer##id }
+
+ret_code_t nrf_drv_timer_init(nrf_drv_timer_t const* inst, void const* cfg, nrf_timer_event_handler_t handler);
+void nrf_drv_timer_enable(nrf_drv_timer_t const* inst);
+void nrf_drv_timer_disable(nrf_drv_timer_t const* inst);
+void nrf_drv_timer_compare(nrf_drv_timer_t const* inst, nrf_timer_cc_channel_t ch, uint32_t cc, bool int_enable);
+
+void nrf_timer_cc_write(struct sim_timer_regs* t, nrf_timer_cc_channel_t ch, uint32_t cc);
+uint32_t nrf_timer_cc_read(struct sim_timer_regs* t, nrf_timer_cc_channel_t ch);
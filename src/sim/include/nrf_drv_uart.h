@@ -0,0 +1,87 @@
+#pragma once
+
+//
+// Simulator stand-in for the UART driver. The bytes are passed to the
+// simulator host side with the transmission time given by the baud rate.
+//
+
+#include "nrf_drv_config.h"
+#include "app_error.h"
+#include "app_util_platform.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef enum {
+    NRF_UART_BAUDRATE_38400   = 38400,
+    NRF_UART_BAUDRATE_115200  = 115200,
+    NRF_UART_BAUDRATE_230400  = 230400,
+    NRF_UART_BAUDRATE_460800  = 460800,
+    NRF_UART_BAUDRATE_921600  = 921600,
+    NRF_UART_BAUDRATE_1000000 = 1000000,
+} nrf_uart_baudrate_t;
+
+typedef struct sim_uart_regs NRF_UART_Type;
+
+#define NRF_UART0 ((NRF_UART_Type*)0)
+
+typedef enum {
+    NRF_UART_HWFC_DISABLED,
+    NRF_UART_HWFC_ENABLED,
+} nrf_uart_hwfc_t;
+
+typedef enum {
+    NRF_UART_PARITY_EXCLUDED,
+    NRF_UART_PARITY_INCLUDED,
+} nrf_uart_parity_t;
+
+typedef enum {
+    NRF_DRV_UART_EVT_TX_DONE,
+    NRF_DRV_UART_EVT_RX_DONE,
+    NRF_DRV_UART_EVT_ERROR,
+} nrf_drv_uart_evt_type_t;
+
+typedef struct {
+    uint32_t            pseltxd;
+    uint32_t            pselrxd;
+    uint32_t            pselcts;
+    uint32_t            pselrts;
+    void *              p_context;
+    nrf_uart_hwfc_t     hwfc;
+    nrf_uart_parity_t   parity;
+    nrf_uart_baudrate_t baudrate;
+    uint8_t             interrupt_priority;
+} nrf_drv_uart_config_t;
+
+#define NRF_DRV_UART_DEFAULT_CONFIG                     \
+    {                                                   \
+        .pseltxd            = UART0_CONFIG_PSEL_TXD,    \
+        .pselrxd            = UART0_CONFIG_PSEL_RXD,    \
+        .pselcts            = UART0_CONFIG_PSEL_CTS,    \
+        .pselrts            = UART0_CONFIG_PSEL_RTS,    \
+        .p_context          = NULL,                     \
+        .hwfc               = UART0_CONFIG_HWFC,        \
+        .parity             = UART0_CONFIG_PARITY,      \
+        .baudrate           = UART0_CONFIG_BAUDRATE,    \
+        .interrupt_priority = UART0_CONFIG_IRQ_PRIORITY \
+    }
+
+typedef struct {
+    uint8_t * p_data;
+    uint8_t   bytes;
+} nrf_drv_uart_xfer_evt_t;
+
+typedef struct {
+    nrf_drv_uart_evt_type_t type;
+    union {
+        nrf_drv_uart_xfer_evt_t rxtx;
+    } data;
+} nrf_drv_uart_event_t;
+
+typedef void (*nrf_uart_event_handler_t)(nrf_drv_uart_event_t * p_event, void * p_context);
+
+ret_code_t nrf_drv_uart_init(nrf_drv_uart_config_t const * p_config, nrf_uart_event_handler_t event_handler);
+ret_code_t nrf_drv_uart_tx(uint8_t const * const p_data, uint8_t length);
+ret_code_t nrf_drv_uart_rx(uint8_t * p_data, uint8_t length);
+
+void nrf_uart_baudrate_set(NRF_UART_Type * p_reg, nrf_uart_baudrate_t baudrate);
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "app_error.h"
+
+typedef unsigned nrf_drv_wdt_channel_id;
+typedef void (*nrf_wdt_event_handler_t)(void);
+
+static inline ret_code_t nrf_drv_wdt_init(void const* cfg, nrf_wdt_event_handler_t handler)
+{
+    return NRF_SUCCESS;
+}
+
+static inline ret_code_t nrf_drv_wdt_channel_alloc(nrf_drv_wdt_channel_id* id)
+{
+    *id = 0;
+    return NRF_SUCCESS;
+}
+
+static inline void nrf_drv_wdt_enable(void) {}
+static inline void nrf_drv_wdt_channel_feed(nrf_drv_wdt_channel_id id) {}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdint.h>
+
+#define NRF_GPIO_PIN_NOPULL 0
+
+static inline void nrf_gpio_cfg_input(uint32_t pin, int pull) {}
+static inline void nrf_gpio_cfg_output(uint32_t pin) {}
+static inline void nrf_gpio_pin_set(uint32_t pin) {}
+static inline void nrf_gpio_pin_clear(uint32_t pin) {}
+
+// Active low data ready lines are always asserted
+static inline uint32_t nrf_gpio_pin_read(uint32_t pin)
+{
+    return 0;
+}
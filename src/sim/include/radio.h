@@ -0,0 +1,35 @@
+#pragma once
+
+//
+// Simulator stand-in for radio.h. Same interface, the packets are sent to
+// the simulator which delivers them to the nodes listening the same channel.
+//
+
+// Setup radio given the packet buffer, packet size and frequency channel
+void radio_configure(void* packet, unsigned sz, unsigned ch);
+
+// Configure clock, send packet and return back to original clock
+void send_packet(void);
+
+typedef void (*receiver_cb_t)(void);
+
+// Configure clock and turn on receiver
+void receiver_on(receiver_cb_t cb);
+
+// Start receiving
+void receive_start(void);
+
+// Change frequency channel, the radio must be disabled
+void radio_set_channel(unsigned ch);
+
+// Change packet buffer, takes effect on the next transmit / receive start
+void radio_set_packet(void* packet);
+
+int radio_address_ok(void);
+int radio_tx_end(void);
+int receive_crc_ok(void);
+
+void transmitter_on_(void);
+void radio_transmit_(void);
+void receiver_on_(receiver_cb_t cb);
+void radio_disable_(void);
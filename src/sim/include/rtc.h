@@ -0,0 +1,24 @@
+#pragma once
+
+//
+// Simulator stand-in for rtc.h. The counter is derived from the virtual time.
+//
+
+#include "nrf_drv_config.h"
+#include "app_error.h"
+
+#define RTC_HZ RTC0_CONFIG_FREQUENCY
+
+typedef unsigned nrf_drv_rtc_int_type_t;
+typedef void (*nrf_drv_rtc_handler_t)(nrf_drv_rtc_int_type_t int_type);
+
+void rtc_initialize(nrf_drv_rtc_handler_t handler);
+
+void rtc_dummy_handler(nrf_drv_rtc_int_type_t int_type);
+
+unsigned rtc_current(void);
+
+void rtc_cc_set(unsigned chan, unsigned time);
+void rtc_cc_schedule(unsigned chan, unsigned time);
+void rtc_cc_reschedule(unsigned chan, unsigned time);
+void rtc_cc_disable(unsigned chan);
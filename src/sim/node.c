@@ -0,0 +1,238 @@
+//
+// Node runtime. The firmware main() runs unmodified, the code below is
+// linked instead of the hardware drivers. The node talks to the master
+// process only when it is going to wait: it reports the time of its next
+// local event and blocks until the master wakes it up either on that time
+// or earlier on some external event (radio packet or UART data).
+//
+
+#include "node.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+static int               g_fd = -1;
+static unsigned          g_bitrate = 250000;
+static uint64_t          g_now;
+static struct sim_timer* g_timers;
+static uint64_t          g_steps;
+static int               g_irq_depth;
+
+uint64_t sim_now(void)
+{
+    return g_now;
+}
+
+unsigned sim_bitrate(void)
+{
+    return g_bitrate;
+}
+
+static void sim_io(int wr, void* buff, unsigned len)
+{
+    uint8_t* p = buff;
+    while (len) {
+        ssize_t r = wr ? write(g_fd, p, len) : read(g_fd, p, len);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            // master has gone
+            exit(0);
+        p += r;
+        len -= r;
+    }
+}
+
+static void sim_send_(sim_msg_type_t type, uint32_t arg, uint64_t time, void const* data, unsigned len)
+{
+    struct sim_msg_hdr h = {
+        .type = type,
+        .len  = len,
+        .arg  = arg,
+        .time = time
+    };
+    if (len > SIM_MSG_MAX_DATA)
+        sim_fatal(__FILE__, __LINE__, "message too long");
+    sim_io(1, &h, sizeof(h));
+    if (len)
+        sim_io(1, (void*)data, len);
+}
+
+void sim_send(sim_msg_type_t type, uint32_t arg, void const* data, unsigned len)
+{
+    sim_send_(type, arg, g_now, data, len);
+}
+
+static void sim_recv(struct sim_msg* m)
+{
+    sim_io(0, &m->h, sizeof(m->h));
+    if (m->h.len > SIM_MSG_MAX_DATA) {
+        fprintf(stderr, "invalid message from master\n");
+        exit(1);
+    }
+    if (m->h.len)
+        sim_io(0, m->data, m->h.len);
+}
+
+void sim_log(const char* fmt, ...)
+{
+    char buff[256];
+    va_list v;
+    va_start(v, fmt);
+    int r = vsnprintf(buff, sizeof(buff), fmt, v);
+    va_end(v);
+    if (r < 0)
+        return;
+    if (r >= (int)sizeof(buff))
+        r = sizeof(buff) - 1;
+    sim_send(msg_log, 0, buff, r);
+}
+
+void sim_fatal(const char* file, int line, const char* what)
+{
+    char buff[256];
+    int r = snprintf(buff, sizeof(buff), "%s:%d: %s", file, line, what);
+    if (r >= (int)sizeof(buff))
+        r = sizeof(buff) - 1;
+    if (g_fd >= 0)
+        sim_send(msg_fatal, 0, buff, r);
+    else
+        fprintf(stderr, "%s\n", buff);
+    exit(1);
+}
+
+//----- Timers ------------------------------------------
+
+void sim_timer_cancel(struct sim_timer* t)
+{
+    struct sim_timer** p;
+    if (!t->active)
+        return;
+    for (p = &g_timers; *p; p = &(*p)->next) {
+        if (*p == t) {
+            *p = t->next;
+            break;
+        }
+    }
+    t->active = 0;
+}
+
+void sim_timer_set(struct sim_timer* t, uint64_t at, void (*fn)(void*), void* arg)
+{
+    struct sim_timer** p;
+    sim_timer_cancel(t);
+    t->at  = at < g_now ? g_now : at;
+    t->fn  = fn;
+    t->arg = arg;
+    // Timers expiring at the same time are fired in the order they were set
+    for (p = &g_timers; *p && (*p)->at <= t->at; p = &(*p)->next)
+        ;
+    t->next = *p;
+    *p = t;
+    t->active = 1;
+}
+
+// Fire the first expired timer, returns 0 if there are no such timers
+static int sim_fire_timer(void)
+{
+    struct sim_timer* t = g_timers;
+    if (!t || t->at > g_now)
+        return 0;
+    g_timers = t->next;
+    t->active = 0;
+    ++g_irq_depth;
+    t->fn(t->arg);
+    --g_irq_depth;
+    return 1;
+}
+
+//----- Waiting -----------------------------------------
+
+// Let the time run till the deadline or the next event whichever comes first.
+// Returns non zero if some event was handled.
+static int sim_step(uint64_t deadline)
+{
+    static struct sim_msg m;
+    if (sim_fire_timer())
+        return 1;
+    if (g_timers && g_timers->at < deadline)
+        deadline = g_timers->at;
+    // The wait message carries the deadline instead of current time
+    sim_send_(msg_wait, 0, deadline, NULL, 0);
+    sim_recv(&m);
+    ++g_steps;
+    if (m.h.type != msg_wake)
+        sim_fatal(__FILE__, __LINE__, "unexpected message");
+    if (m.h.time < g_now)
+        sim_fatal(__FILE__, __LINE__, "time goes back");
+    g_now = m.h.time;
+    switch (m.h.arg) {
+    case ev_none:
+        return sim_fire_timer();
+    case ev_rx_address:
+    case ev_rx_end:
+        ++g_irq_depth;
+        sim_radio_event(&m);
+        --g_irq_depth;
+        return 1;
+    case ev_uart_rx:
+        ++g_irq_depth;
+        sim_uart_event(&m);
+        --g_irq_depth;
+        return 1;
+    default:
+        sim_fatal(__FILE__, __LINE__, "unknown event");
+        return 0;
+    }
+}
+
+void sim_sleep(uint64_t us)
+{
+    uint64_t deadline = g_now + us;
+    while (g_now < deadline)
+        sim_step(deadline);
+}
+
+void sim_wait_event(void)
+{
+    while (!sim_step(SIM_FOREVER))
+        ;
+}
+
+void sim_poll(void)
+{
+    sim_step(sim_poll_deadline());
+}
+
+void sim_irq_enable(void)
+{
+    static uint64_t last_steps = ~0;
+    // Enabling interrupts again without waiting means the code is busy waiting
+    // for some event, let the time run then.
+    if (g_irq_depth)
+        return;
+    if (g_steps == last_steps)
+        sim_poll();
+    last_steps = g_steps;
+}
+
+__attribute__((constructor))
+static void sim_node_init(void)
+{
+    const char* fd = getenv(SIM_ENV_FD);
+    const char* bitrate = getenv(SIM_ENV_BITRATE);
+    const char* now = getenv(SIM_ENV_TIME);
+    if (!fd) {
+        fprintf(stderr, "the node should be started by the simulator\n");
+        exit(1);
+    }
+    g_fd = atoi(fd);
+    if (bitrate)
+        g_bitrate = atoi(bitrate);
+    if (now)
+        g_now = strtoull(now, NULL, 10);
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+//
+// Node side of the simulator. Stands in for the hardware the firmware
+// runs on: virtual time, timers and interrupts delivery.
+//
+
+#include "sim.h"
+
+// Current virtual time in usec
+uint64_t sim_now(void);
+
+// Local timer calling fn(arg) at the given time
+struct sim_timer {
+    uint64_t          at;
+    void              (*fn)(void* arg);
+    void*             arg;
+    struct sim_timer* next;
+    int               active;
+};
+
+void sim_timer_set(struct sim_timer* t, uint64_t at, void (*fn)(void*), void* arg);
+void sim_timer_cancel(struct sim_timer* t);
+
+// Busy wait for the given time, interrupts are delivered meanwhile
+void sim_sleep(uint64_t us);
+
+// Sleep till the next interrupt
+void sim_wait_event(void);
+
+// Poll hardware state, let the time run if nothing happened
+void sim_poll(void);
+
+// Called on enabling interrupts, detects busy waiting
+void sim_irq_enable(void);
+
+// The time the polling node may sleep till since nothing may change
+// before it (the next RTC tick)
+uint64_t sim_poll_deadline(void);
+
+// Send message to master
+void sim_send(sim_msg_type_t type, uint32_t arg, void const* data, unsigned len);
+
+void sim_log(const char* fmt, ...);
+void sim_fatal(const char* file, int line, const char* what);
+
+unsigned sim_bitrate(void);
+
+// External events handlers
+void sim_radio_event(struct sim_msg const* m);
+void sim_uart_event(struct sim_msg const* m);
@@ -0,0 +1,328 @@
+//
+// Peripherals models: RTC, TIMER, UART, flash and ADS1220 ADC.
+// Compiled with every node configuration since RTC frequency differs.
+//
+
+#include "nrf.h"
+#include "rtc.h"
+#include "clock.h"
+#include "nrf_drv_timer.h"
+#include "nrf_drv_uart.h"
+#include "ble_flash.h"
+#include "ads1220.h"
+#include "node.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+int g_sim_hf_osc;
+
+//----- RTC ---------------------------------------------
+
+#define RTC_CC 4
+
+static nrf_drv_rtc_handler_t g_rtc_handler;
+static unsigned              g_rtc_cc[RTC_CC];
+static struct sim_timer      g_rtc_timer[RTC_CC];
+
+static inline uint64_t rtc_ticks(uint64_t us)
+{
+    return us * RTC_HZ / 1000000;
+}
+
+static inline uint64_t rtc_tick_time(uint64_t tick)
+{
+    return (tick * 1000000 + RTC_HZ - 1) / RTC_HZ;
+}
+
+uint64_t sim_poll_deadline(void)
+{
+    return rtc_tick_time(rtc_ticks(sim_now()) + 1);
+}
+
+void rtc_initialize(nrf_drv_rtc_handler_t handler)
+{
+    g_rtc_handler = handler;
+}
+
+void rtc_dummy_handler(nrf_drv_rtc_int_type_t int_type)
+{
+}
+
+unsigned rtc_current(void)
+{
+    return rtc_ticks(sim_now());
+}
+
+static void rtc_cc_fired(void* arg)
+{
+    unsigned chan = (uintptr_t)arg;
+    g_rtc_handler(chan);
+}
+
+void rtc_cc_set(unsigned chan, unsigned cc)
+{
+    uint64_t now = rtc_ticks(sim_now());
+    int delta = cc - (unsigned)now;
+    if (chan >= RTC_CC)
+        sim_fatal(__FILE__, __LINE__, "invalid RTC channel");
+    if (!g_rtc_handler)
+        sim_fatal(__FILE__, __LINE__, "RTC is not initialized");
+    // Compare register set to the current or past value matches on the next tick at best
+    if (delta <= 0)
+        delta = 1;
+    g_rtc_cc[chan] = cc;
+    sim_timer_set(&g_rtc_timer[chan], rtc_tick_time(now + delta), rtc_cc_fired, (void*)(uintptr_t)chan);
+}
+
+void rtc_cc_schedule(unsigned chan, unsigned time)
+{
+    rtc_cc_set(chan, rtc_current() + time);
+}
+
+void rtc_cc_reschedule(unsigned chan, unsigned time)
+{
+    rtc_cc_set(chan, g_rtc_cc[chan] + time);
+}
+
+void rtc_cc_disable(unsigned chan)
+{
+    sim_timer_cancel(&g_rtc_timer[chan]);
+}
+
+//----- TIMER (1MHz) ------------------------------------
+
+struct sim_timer_regs {
+    nrf_timer_event_handler_t handler;
+    int                       enabled;
+    uint64_t                  start;
+    uint32_t                  cc[SIM_TIMER_CC];
+    int                       int_en[SIM_TIMER_CC];
+    struct sim_timer          t[SIM_TIMER_CC];
+};
+
+struct sim_timer_regs g_sim_timer0;
+
+static void timer_fired(void* arg)
+{
+    struct sim_timer* t = arg;
+    struct sim_timer_regs* r = &g_sim_timer0;
+    unsigned ch = t - r->t;
+    r->handler((nrf_timer_event_t)(NRF_TIMER_EVENT_COMPARE0 + ch), NULL);
+}
+
+static void timer_arm(struct sim_timer_regs* r, unsigned ch)
+{
+    uint32_t counter = sim_now() - r->start;
+    if (!r->enabled || !r->int_en[ch] || r->cc[ch] <= counter) {
+        // The counter will reach the compare value only after wrapping around
+        sim_timer_cancel(&r->t[ch]);
+        return;
+    }
+    sim_timer_set(&r->t[ch], r->start + r->cc[ch], timer_fired, &r->t[ch]);
+}
+
+ret_code_t nrf_drv_timer_init(nrf_drv_timer_t const* inst, void const* cfg, nrf_timer_event_handler_t handler)
+{
+    inst->p_reg->handler = handler;
+    return NRF_SUCCESS;
+}
+
+void nrf_drv_timer_enable(nrf_drv_timer_t const* inst)
+{
+    struct sim_timer_regs* r = inst->p_reg;
+    unsigned ch;
+    r->enabled = 1;
+    r->start = sim_now();
+    for (ch = 0; ch < SIM_TIMER_CC; ++ch)
+        timer_arm(r, ch);
+}
+
+void nrf_drv_timer_disable(nrf_drv_timer_t const* inst)
+{
+    struct sim_timer_regs* r = inst->p_reg;
+    unsigned ch;
+    r->enabled = 0;
+    for (ch = 0; ch < SIM_TIMER_CC; ++ch)
+        sim_timer_cancel(&r->t[ch]);
+}
+
+void nrf_drv_timer_compare(nrf_drv_timer_t const* inst, nrf_timer_cc_channel_t ch, uint32_t cc, bool int_enable)
+{
+    inst->p_reg->int_en[ch] = int_enable;
+    nrf_timer_cc_write(inst->p_reg, ch, cc);
+}
+
+void nrf_timer_cc_write(struct sim_timer_regs* r, nrf_timer_cc_channel_t ch, uint32_t cc)
+{
+    r->cc[ch] = cc;
+    timer_arm(r, ch);
+}
+
+uint32_t nrf_timer_cc_read(struct sim_timer_regs* r, nrf_timer_cc_channel_t ch)
+{
+    return r->cc[ch];
+}
+
+//----- UART --------------------------------------------
+
+#define NRF_ERROR_BUSY 17
+#define UART_RX_FIFO_SZ 1024
+
+static nrf_uart_event_handler_t g_uart_handler;
+static unsigned                 g_uart_byte_us;
+static uint8_t const*           g_uart_tx_data;
+static uint8_t                  g_uart_tx_len;
+static struct sim_timer         g_uart_tx_timer;
+static uint8_t*                 g_uart_rx_data;
+static uint8_t                  g_uart_rx_len;
+static uint8_t                  g_uart_rx_fifo[UART_RX_FIFO_SZ];
+static unsigned                 g_uart_rx_head, g_uart_rx_tail;
+static struct sim_timer         g_uart_rx_timer;
+
+void nrf_uart_baudrate_set(NRF_UART_Type * p_reg, nrf_uart_baudrate_t baudrate)
+{
+    // start bit, 8 data bits, stop bit
+    uint32_t rate = baudrate;
+    g_uart_byte_us = (10 * 1000000 + rate - 1) / rate;
+    // The master garbles the data if the host uses different baud rate
+    sim_send(msg_uart_baud, 0, &rate, sizeof(rate));
+}
+
+ret_code_t nrf_drv_uart_init(nrf_drv_uart_config_t const * p_config, nrf_uart_event_handler_t event_handler)
+{
+    g_uart_handler = event_handler;
+    nrf_uart_baudrate_set(NRF_UART0, p_config->baudrate);
+    return NRF_SUCCESS;
+}
+
+static void uart_tx_done(void* arg)
+{
+    nrf_drv_uart_event_t evt = {
+        .type = NRF_DRV_UART_EVT_TX_DONE,
+        .data.rxtx = {.p_data = (uint8_t*)g_uart_tx_data, .bytes = g_uart_tx_len}
+    };
+    sim_send(msg_uart_tx, 0, g_uart_tx_data, g_uart_tx_len);
+    g_uart_tx_data = NULL;
+    g_uart_handler(&evt, NULL);
+}
+
+ret_code_t nrf_drv_uart_tx(uint8_t const * const p_data, uint8_t length)
+{
+    if (g_uart_tx_data)
+        return NRF_ERROR_BUSY;
+    g_uart_tx_data = p_data;
+    g_uart_tx_len  = length;
+    sim_timer_set(&g_uart_tx_timer, sim_now() + length * g_uart_byte_us, uart_tx_done, NULL);
+    return NRF_SUCCESS;
+}
+
+static void uart_rx_byte(void* arg)
+{
+    nrf_drv_uart_event_t evt = {.type = NRF_DRV_UART_EVT_RX_DONE};
+    if (g_uart_rx_head == g_uart_rx_tail)
+        return;
+    if (!g_uart_rx_data) {
+        // Hardware flow control holds the host till the receive is started
+        return;
+    }
+    *g_uart_rx_data = g_uart_rx_fifo[g_uart_rx_tail++ % UART_RX_FIFO_SZ];
+    evt.data.rxtx.p_data = g_uart_rx_data;
+    evt.data.rxtx.bytes  = 1;
+    g_uart_rx_data = NULL;
+    g_uart_handler(&evt, NULL);
+    if (g_uart_rx_head != g_uart_rx_tail)
+        sim_timer_set(&g_uart_rx_timer, sim_now() + g_uart_byte_us, uart_rx_byte, NULL);
+}
+
+ret_code_t nrf_drv_uart_rx(uint8_t * p_data, uint8_t length)
+{
+    if (g_uart_rx_data)
+        return NRF_ERROR_BUSY;
+    if (length != 1)
+        sim_fatal(__FILE__, __LINE__, "only single byte receive is supported");
+    g_uart_rx_data = p_data;
+    g_uart_rx_len  = length;
+    if (g_uart_rx_head != g_uart_rx_tail && !g_uart_rx_timer.active)
+        sim_timer_set(&g_uart_rx_timer, sim_now() + g_uart_byte_us, uart_rx_byte, NULL);
+    return NRF_SUCCESS;
+}
+
+void sim_uart_event(struct sim_msg const* m)
+{
+    unsigned i;
+    if (g_uart_rx_head - g_uart_rx_tail + m->h.len > UART_RX_FIFO_SZ)
+        sim_fatal(__FILE__, __LINE__, "UART receive overflow");
+    for (i = 0; i < m->h.len; ++i)
+        g_uart_rx_fifo[g_uart_rx_head++ % UART_RX_FIFO_SZ] = m->data[i];
+    if (!g_uart_rx_timer.active)
+        sim_timer_set(&g_uart_rx_timer, sim_now() + g_uart_byte_us, uart_rx_byte, NULL);
+}
+
+//----- Flash -------------------------------------------
+
+#define FLASH_PAGE_SZ 1024
+
+uint32_t ble_flash_page_erase(unsigned page_num)
+{
+    memset((void*)((uintptr_t)page_num * FLASH_PAGE_SZ), 0xff, FLASH_PAGE_SZ);
+    return NRF_SUCCESS;
+}
+
+uint32_t ble_flash_word_write(uint32_t* p_address, uint32_t value)
+{
+    // Programming may only clear bits
+    *p_address &= value;
+    return NRF_SUCCESS;
+}
+
+uint32_t ble_flash_block_write(uint32_t* p_address, uint32_t* p_in_array, uint16_t word_count)
+{
+    unsigned i;
+    for (i = 0; i < word_count; ++i)
+        ble_flash_word_write(p_address + i, p_in_array[i]);
+    return NRF_SUCCESS;
+}
+
+//----- ADS1220 -----------------------------------------
+
+// The current transformer signal amplitude in ADC units and battery voltage code
+// are given by SIM_POWER (W) and SIM_VBATT (V) environment variables. The
+// scaling reverses the one used by the transmitter.
+#define SIM_AMPL_SCALING (.2 * 1.10 * 50000. / (1 << 23))
+#define SIM_MAINS_HZ 50
+
+static int g_ads_vcc;
+
+void ads_initialize(void)
+{
+}
+
+void ads_configure(uint8_t cfg[4])
+{
+    g_ads_vcc = cfg[0] == ADS_CFG0_VCC_4;
+}
+
+void ads_send_cmd(uint8_t cmd)
+{
+}
+
+static double env_value(const char* name, double def)
+{
+    const char* v = getenv(name);
+    return v ? atof(v) : def;
+}
+
+int32_t ads_transfer(uint8_t cmd)
+{
+    if (g_ads_vcc) {
+        // Inverse of ads_vcc_dmv()
+        uint32_t dmv = env_value("SIM_VBATT", 3.8) * 10000;
+        return ((dmv << 16) / 81920) << 7;
+    } else {
+        double ampl = env_value("SIM_POWER", 1000) / SIM_AMPL_SCALING;
+        double ph = 2 * M_PI * SIM_MAINS_HZ * (sim_now() % 1000000) / 1e6;
+        return (int32_t)(ampl * sin(ph));
+    }
+}
@@ -0,0 +1,167 @@
+//
+// Radio model. Implements radio.h on top of the simulator air.
+//
+
+#include "radio.h"
+#include "clock.h"
+#include "node.h"
+
+#include <string.h>
+
+typedef enum {
+    radio_disabled,
+    radio_tx_idle,
+    radio_rx_idle,
+    radio_rx,
+} radio_state_t;
+
+static radio_state_t g_state;
+static uint8_t*      g_packet;
+static unsigned      g_static_len;
+static unsigned      g_channel;
+static receiver_cb_t g_receive_cb;
+static int           g_irq_enabled;
+static int           g_evt_address;
+static int           g_evt_end;
+static int           g_crc_ok;
+
+#define MAX_LEN 255
+
+void radio_configure(void* packet, unsigned sz, unsigned ch)
+{
+    g_packet     = packet;
+    g_static_len = sz;
+    g_channel    = ch;
+}
+
+void radio_set_channel(unsigned ch)
+{
+    if (g_state != radio_disabled)
+        sim_fatal(__FILE__, __LINE__, "changing channel while radio is enabled");
+    g_channel = ch;
+}
+
+void radio_set_packet(void* packet)
+{
+    g_packet = packet;
+}
+
+int radio_address_ok(void)
+{
+    return g_evt_address;
+}
+
+int radio_tx_end(void)
+{
+    if (!g_evt_end)
+        sim_poll();
+    return g_evt_end;
+}
+
+int receive_crc_ok(void)
+{
+    return g_crc_ok;
+}
+
+static unsigned packet_len(void)
+{
+    return g_static_len ? g_static_len : 1 + g_packet[0];
+}
+
+void transmitter_on_(void)
+{
+    if (g_state != radio_disabled)
+        sim_fatal(__FILE__, __LINE__, "radio is enabled already");
+    sim_sleep(SIM_RADIO_RAMP_US);
+    g_state = radio_tx_idle;
+}
+
+void radio_transmit_(void)
+{
+    unsigned len = packet_len();
+    if (g_state != radio_tx_idle)
+        sim_fatal(__FILE__, __LINE__, "transmitter is not ready");
+    if (!hf_osc_active())
+        sim_fatal(__FILE__, __LINE__, "transmitting without crystal oscillator");
+    g_evt_address = 0;
+    g_evt_end = 0;
+    sim_send(msg_tx, g_channel, g_packet, len);
+    sim_sleep(sim_airtime(len, sim_bitrate()));
+}
+
+void radio_disable_(void)
+{
+    if (g_state == radio_rx)
+        sim_send(msg_rx_off, 0, NULL, 0);
+    g_state = radio_disabled;
+    g_irq_enabled = 0;
+}
+
+void send_packet(void)
+{
+    int hf_clk_active = hf_osc_active();
+    if (!hf_clk_active)
+        hf_osc_start();
+
+    transmitter_on_();
+    radio_transmit_();
+    radio_disable_();
+
+    if (!hf_clk_active)
+        hf_osc_stop();
+}
+
+void receiver_on_(receiver_cb_t cb)
+{
+    if (g_state != radio_disabled)
+        sim_fatal(__FILE__, __LINE__, "radio is enabled already");
+    if (cb) {
+        g_receive_cb  = cb;
+        g_irq_enabled = 1;
+    }
+    sim_sleep(SIM_RADIO_RAMP_US);
+    g_state = radio_rx_idle;
+}
+
+void receiver_on(receiver_cb_t cb)
+{
+    if (!hf_osc_active())
+        hf_osc_start();
+    receiver_on_(cb);
+}
+
+void receive_start(void)
+{
+    if (g_state != radio_rx_idle)
+        sim_fatal(__FILE__, __LINE__, "receiver is not ready");
+    if (!hf_osc_active())
+        sim_fatal(__FILE__, __LINE__, "receiving without crystal oscillator");
+    g_evt_address = 0;
+    g_evt_end = 0;
+    g_state = radio_rx;
+    sim_send(msg_rx_on, g_channel, NULL, 0);
+}
+
+void sim_radio_event(struct sim_msg const* m)
+{
+    if (g_state != radio_rx)
+        // The master should not deliver packets after receiver was disabled
+        sim_fatal(__FILE__, __LINE__, "unexpected radio event");
+    if (m->h.arg == ev_rx_address) {
+        g_evt_address = 1;
+        return;
+    }
+    unsigned len = m->h.len;
+    unsigned max_len = g_static_len ? g_static_len : 1 + MAX_LEN;
+    if (len > max_len)
+        len = max_len;
+    memcpy(g_packet, m->data, len);
+    // The receiver stops after the packet end
+    g_state   = radio_rx_idle;
+    g_crc_ok  = len == m->h.len && (m->h.flags & SIM_CRC_OK);
+    g_evt_end = 1;
+    if (g_irq_enabled) {
+        g_receive_cb();
+        g_evt_end = 0;
+    }
+}
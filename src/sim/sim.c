@@ -0,0 +1,951 @@
+//
+// Link simulator master process.
+//
+// Runs the transmitter and receiver firmware (sim_tx and sim_rx built from
+// the real sources) in the virtual time, models the radio channel between
+// them and emulates the host talking to the receiver over UART. The same
+// options and seed always give the same results.
+//
+// Usage: sim [options]
+//  --time=S           simulated time in seconds (3600)
+//  --seed=N           random generator seed (1)
+//  --bitrate=N        radio bitrate (250000)
+//  --loss=P           packet loss probability on all channels (0)
+//  --chan-loss=CH:P,.. packet loss probability on particular channels
+//  --latency=US       packet propagation delay (0)
+//  --bit-errors=P     probability of the packet delivered with a bit error undetected by radio CRC (0)
+//  --download[=T]     retrieve data pages the same way pwmon does at T seconds (600)
+//  --poll             retrieve data pages by qd queries instead of streaming
+//  --pipeline=N       retrieve data pages by binary requests keeping N of them outstanding
+//  --cached           retrieve data pages cached by the receiver without the radio
+//  --baud=N           negotiate UART baud rate N before retrieving data
+//  --host-baud-max=N  the host UART adapter baud rate limit (1000000)
+//  --host-delay=MS    delay before sending the next command to receiver (1)
+//  --cmd=T:CMD        send command to receiver at T seconds and print response
+//  --power=W          power measured by the transmitter (1000)
+//  --vbatt=V          transmitter battery voltage (3.8)
+//  --tx-restart=S     restart the transmitter at S seconds
+//  -v                 print packets and nodes log messages
+//
+
+#include "sim.h"
+#include "proto.h"
+#include "crc32.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <libgen.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define US 1000000ULL
+
+//----- Options -----------------------------------------
+
+static uint64_t g_end_time = 3600 * US;
+static uint64_t g_seed     = 1;
+static unsigned g_bitrate  = 250000;
+static uint64_t g_latency;
+static double   g_chan_loss[MAX_CHANNEL+1];
+static double   g_bit_errors;
+static int      g_download;
+static uint64_t g_download_time = 600 * US;
+static int      g_download_poll;
+static unsigned g_download_pipeline;
+static int      g_download_cached;
+static unsigned g_baud;
+static unsigned g_host_baud_max = 1000000;
+static uint64_t g_host_delay = 1000;
+static const char* g_power = "1000";
+static const char* g_vbatt = "3.8";
+static uint64_t g_tx_restart_time;
+static int      g_verbose;
+
+#define MAX_CMDS 16
+
+static struct host_cmd {
+    uint64_t    time;
+    const char* cmd;
+} g_cmds[MAX_CMDS];
+
+static unsigned g_ncmds;
+
+//----- Common ------------------------------------------
+
+static uint64_t g_now;
+
+static void fatal(const char* fmt, ...) __attribute__((format(printf, 1, 2), noreturn));
+
+static void cleanup(void);
+
+static void fatal(const char* fmt, ...)
+{
+    va_list v;
+    va_start(v, fmt);
+    fprintf(stderr, "%.6f: ", (double)g_now / US);
+    vfprintf(stderr, fmt, v);
+    fprintf(stderr, "\n");
+    va_end(v);
+    cleanup();
+    exit(1);
+}
+
+// xorshift64* generator
+static double rnd(void)
+{
+    g_seed ^= g_seed >> 12;
+    g_seed ^= g_seed << 25;
+    g_seed ^= g_seed >> 27;
+    return (double)((g_seed * 2685821657736338717ULL) >> 11) / (1ULL << 53);
+}
+
+//----- Nodes -------------------------------------------
+
+struct air_packet;
+
+struct node {
+    const char*        name;
+    char*              path;
+    pid_t              pid;
+    int                fd;
+    uint64_t           deadline;
+    int                listening;
+    unsigned           chan;
+    struct air_packet* lock; // the packet being received
+    int                lock_crc_ok;
+    int                rx_enabled; // the receiver was not turned off since the last rx_on
+    uint64_t           rx_enabled_ts;
+    uint64_t           rx_time;    // total receiver enabled time
+};
+
+enum {
+    node_tx,
+    node_rx,
+    node_count
+};
+
+static struct node g_nodes[node_count] = {
+    [node_tx] = {.name = "tx", .fd = -1},
+    [node_rx] = {.name = "rx", .fd = -1},
+};
+
+//----- Statistics --------------------------------------
+
+#define PKT_TYPES 4
+
+static const char* g_pkt_names[PKT_TYPES] = {"report", "data_req", "data", "layout"};
+
+static struct pkt_stat {
+    unsigned sent;
+    unsigned received;
+    unsigned lost;
+    unsigned corrupted;
+    unsigned bit_errors; // received with undetected bit error
+} g_pkt_stat[PKT_TYPES+1];
+
+static struct pkt_stat* pkt_stat(uint8_t const* data, unsigned len)
+{
+    struct packet_hdr const* h = (struct packet_hdr const*)data;
+    if (len < sizeof(*h) || h->type >= PKT_TYPES)
+        return &g_pkt_stat[PKT_TYPES];
+    return &g_pkt_stat[h->type];
+}
+
+//----- Node communications -----------------------------
+
+static void node_io(struct node* n, int wr, void* buff, unsigned len)
+{
+    uint8_t* p = buff;
+    while (len) {
+        ssize_t r = wr ? write(n->fd, p, len) : read(n->fd, p, len);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            fatal("%s node terminated unexpectedly", n->name);
+        p += r;
+        len -= r;
+    }
+}
+
+static void host_input(uint8_t const* data, unsigned len);
+
+static uint32_t g_uart_baud = 230400; // receiver side UART baud rate
+
+static void node_rx_off(struct node* n);
+
+static void air_transmit(struct node* src, unsigned chan, uint8_t const* data, unsigned len);
+
+// Let the node run till it is going to wait
+static void node_run(struct node* n)
+{
+    static struct sim_msg m;
+    for (;;) {
+        node_io(n, 0, &m.h, sizeof(m.h));
+        if (m.h.len > SIM_MSG_MAX_DATA)
+            fatal("invalid message from %s node", n->name);
+        if (m.h.len)
+            node_io(n, 0, m.data, m.h.len);
+        switch (m.h.type) {
+        case msg_wait:
+            if (m.h.time < g_now)
+                fatal("%s node deadline is in the past", n->name);
+            n->deadline = m.h.time;
+            return;
+        case msg_tx:
+            air_transmit(n, m.h.arg, m.data, m.h.len);
+            break;
+        case msg_rx_on:
+            if (m.h.arg > MAX_CHANNEL)
+                fatal("%s node: invalid channel %u", n->name, m.h.arg);
+            if (!n->rx_enabled) {
+                n->rx_enabled = 1;
+                n->rx_enabled_ts = g_now;
+            }
+            n->listening = 1;
+            n->chan = m.h.arg;
+            n->lock = NULL;
+            break;
+        case msg_rx_off:
+            node_rx_off(n);
+            break;
+        case msg_uart_tx:
+            host_input(m.data, m.h.len);
+            break;
+        case msg_uart_baud:
+            if (m.h.len != sizeof(g_uart_baud))
+                fatal("%s node: invalid baud rate message", n->name);
+            memcpy(&g_uart_baud, m.data, sizeof(g_uart_baud));
+            break;
+        case msg_log:
+            if (g_verbose)
+                printf("%.6f %s: %.*s\n", (double)g_now / US, n->name, m.h.len, m.data);
+            break;
+        case msg_fatal:
+            fatal("%s node: %.*s", n->name, m.h.len, m.data);
+        default:
+            fatal("unknown message from %s node", n->name);
+        }
+    }
+}
+
+static void node_wake(struct node* n, sim_event_t ev, unsigned flags, void const* data, unsigned len)
+{
+    struct sim_msg_hdr h = {
+        .type  = msg_wake,
+        .len   = len,
+        .arg   = ev,
+        .flags = flags,
+        .time  = g_now
+    };
+    node_io(n, 1, &h, sizeof(h));
+    if (len)
+        node_io(n, 1, (void*)data, len);
+    node_run(n);
+}
+
+static void node_start(struct node* n, const char* path)
+{
+    int sv[2];
+    char buff[32];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        perror("socketpair");
+        exit(1);
+    }
+    fflush(stdout);
+    n->pid = fork();
+    if (n->pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (!n->pid) {
+        close(sv[0]);
+        snprintf(buff, sizeof(buff), "%d", sv[1]);
+        setenv(SIM_ENV_FD, buff, 1);
+        snprintf(buff, sizeof(buff), "%u", g_bitrate);
+        setenv(SIM_ENV_BITRATE, buff, 1);
+        snprintf(buff, sizeof(buff), "%llu", (unsigned long long)g_now);
+        setenv(SIM_ENV_TIME, buff, 1);
+        setenv("SIM_POWER", g_power, 1);
+        setenv("SIM_VBATT", g_vbatt, 1);
+        execl(path, path, (char*)NULL);
+        perror(path);
+        _exit(1);
+    }
+    close(sv[1]);
+    n->fd = sv[0];
+    node_run(n);
+}
+
+static void node_stop(struct node* n)
+{
+    if (n->fd >= 0) {
+        close(n->fd);
+        n->fd = -1;
+    }
+    if (n->pid > 0) {
+        kill(n->pid, SIGKILL);
+        waitpid(n->pid, NULL, 0);
+        n->pid = 0;
+    }
+}
+
+// The node starts from scratch as on the power up except the RTC which keeps
+// the simulated time
+static void node_restart(struct node* n)
+{
+    if (g_verbose)
+        printf("%.6f %s: restart\n", (double)g_now / US, n->name);
+    node_stop(n);
+    node_rx_off(n);
+    node_start(n, n->path);
+}
+
+static void cleanup(void)
+{
+    int i;
+    for (i = 0; i < node_count; ++i)
+        node_stop(&g_nodes[i]);
+}
+
+//----- Events ------------------------------------------
+
+typedef enum {
+    evt_air_start,
+    evt_air_address,
+    evt_air_end,
+    evt_host_cmd,
+    evt_host_next,
+    evt_host_tout,
+    evt_tx_restart,
+} evt_type_t;
+
+struct event {
+    uint64_t           time;
+    unsigned           seq;
+    evt_type_t         type;
+    struct air_packet* pkt;
+    const char*        cmd;
+};
+
+#define MAX_EVENTS 64
+
+static struct event g_events[MAX_EVENTS];
+static unsigned     g_nevents;
+static unsigned     g_event_seq;
+
+static void event_add(uint64_t time, evt_type_t type, struct air_packet* pkt, const char* cmd)
+{
+    if (g_nevents >= MAX_EVENTS)
+        fatal("too many events");
+    g_events[g_nevents++] = (struct event){
+        .time = time,
+        .seq  = g_event_seq++,
+        .type = type,
+        .pkt  = pkt,
+        .cmd  = cmd
+    };
+}
+
+// Returns the index of the earliest event or -1
+static int event_first(void)
+{
+    int i, first = -1;
+    for (i = 0; i < (int)g_nevents; ++i) {
+        struct event const* e = &g_events[i];
+        if (first < 0 || e->time < g_events[first].time ||
+            (e->time == g_events[first].time && e->seq < g_events[first].seq))
+            first = i;
+    }
+    return first;
+}
+
+//----- Air ---------------------------------------------
+
+struct air_packet {
+    struct node* src;
+    unsigned     chan;
+    unsigned     len;
+    uint8_t      data[256];
+};
+
+static void air_transmit(struct node* src, unsigned chan, uint8_t const* data, unsigned len)
+{
+    struct air_packet* p;
+    if (len > sizeof(p->data))
+        fatal("%s node: packet too long", src->name);
+    p = malloc(sizeof(*p));
+    p->src  = src;
+    p->chan = chan;
+    p->len  = len;
+    memcpy(p->data, data, len);
+    ++pkt_stat(data, len)->sent;
+    if (g_verbose)
+        printf("%.6f %s: tx %u bytes on channel %u\n", (double)g_now / US, src->name, len, chan);
+    event_add(g_now + g_latency, evt_air_start, p, NULL);
+    event_add(g_now + g_latency + sim_bytes_time(SIM_RADIO_ADDR_SZ, g_bitrate), evt_air_address, p, NULL);
+    event_add(g_now + g_latency + sim_airtime(len, g_bitrate), evt_air_end, p, NULL);
+}
+
+// Collision with the packet being received on the same channel
+static void air_start(struct air_packet* p)
+{
+    int i;
+    for (i = 0; i < node_count; ++i) {
+        struct node* n = &g_nodes[i];
+        if (n->lock && n->lock->chan == p->chan)
+            n->lock_crc_ok = 0;
+    }
+}
+
+static void air_address(struct air_packet* p)
+{
+    int i;
+    for (i = 0; i < node_count; ++i) {
+        struct node* n = &g_nodes[i];
+        if (n == p->src || !n->listening || n->lock || n->chan != p->chan)
+            continue;
+        if (rnd() < g_chan_loss[p->chan]) {
+            ++pkt_stat(p->data, p->len)->lost;
+            continue;
+        }
+        n->lock = p;
+        n->lock_crc_ok = 1;
+        node_wake(n, ev_rx_address, 0, NULL, 0);
+    }
+}
+
+static void air_end(struct air_packet* p)
+{
+    int i;
+    for (i = 0; i < node_count; ++i) {
+        struct node* n = &g_nodes[i];
+        if (n->lock != p)
+            continue;
+        n->lock = NULL;
+        n->listening = 0;
+        if (n->lock_crc_ok)
+            ++pkt_stat(p->data, p->len)->received;
+        else
+            ++pkt_stat(p->data, p->len)->corrupted;
+        if (n->lock_crc_ok && p->len > 1 && rnd() < g_bit_errors) {
+            // Keep the length byte intact so the packet is still accepted
+            unsigned bit = 8 + (unsigned)(rnd() * 8 * (p->len - 1));
+            ++pkt_stat(p->data, p->len)->bit_errors;
+            p->data[bit / 8] ^= 1 << (bit % 8);
+        }
+        node_wake(n, ev_rx_end, n->lock_crc_ok ? SIM_CRC_OK : 0, p->data, p->len);
+    }
+    free(p);
+}
+
+static void node_rx_off(struct node* n)
+{
+    if (n->rx_enabled) {
+        n->rx_enabled = 0;
+        n->rx_time += g_now - n->rx_enabled_ts;
+    }
+    n->listening = 0;
+    n->lock = NULL;
+}
+
+//----- Host --------------------------------------------
+
+// x_status_t values reported by the receiver
+#define X_COMPLETED 4
+#define X_FAILED    5
+
+#define FRAME_HDR_SZ 6
+#define FRAME_PART   '+' // the long text response part separator
+
+// Binary request: SOF, operation code, request id, payload length, payload, CRC32
+#define BIN_SOF     '~'
+#define BIN_HDR_SZ  3
+#define BIN_OP_PAGE 2
+
+// The time the host waits for the response before giving up
+#define HOST_TOUT (100 * 1000)
+// The receiver restores baud rate if it is not confirmed in 1 sec
+#define BAUD_RESTORE_TOUT (1100 * 1000)
+
+static uint8_t  g_host_buff[FRAME_HDR_SZ + 0x10000];
+static unsigned g_host_len;
+static int      g_host_busy;
+static const char* g_host_cmd;
+static uint32_t g_host_baud = 230400;
+
+enum {
+    dl_baud,   // waiting baud rate switch response
+    dl_verify, // waiting new baud rate confirmation response
+    dl_start,  // waiting transfer start response
+    dl_data,   // receiving data
+};
+
+static struct {
+    int      active;
+    int      done;
+    int      phase;
+    uint32_t prev_baud;
+    uint64_t start;
+    uint64_t end;
+    unsigned pages;
+    unsigned status;
+    unsigned data_req_sent;
+    unsigned data_sent;
+    uint8_t  req_id;  // the next binary request id
+    uint8_t  resp_id; // the next binary response id expected
+} g_dl;
+
+static void host_send_raw(char* buff, unsigned len)
+{
+    if (g_host_baud != g_uart_baud) {
+        // The receiver gets garbage on baud rate mismatch
+        int i;
+        for (i = 0; i < len; ++i)
+            buff[i] ^= 0x55;
+    }
+    node_wake(&g_nodes[node_rx], ev_uart_rx, 0, buff, len);
+}
+
+static void host_send(const char* cmd)
+{
+    char buff[64];
+    int len = snprintf(buff, sizeof(buff), "%s\r", cmd);
+    if (g_verbose)
+        printf("%.6f host: %s\n", (double)g_now / US, cmd);
+    // Streamed frames acknowledgements have no response
+    g_host_busy = strcmp(cmd, "a") != 0;
+    g_host_cmd = cmd;
+    host_send_raw(buff, len);
+}
+
+// Send binary data page request for transmitter 0
+static void host_send_page_req(void)
+{
+    char buff[1 + BIN_HDR_SZ + 1 + sizeof(uint32_t)] = {BIN_SOF, BIN_OP_PAGE, g_dl.req_id++, 1, 0};
+    uint32_t crc = crc32((uint8_t*)buff + 1, BIN_HDR_SZ + 1);
+    memcpy(buff + 1 + BIN_HDR_SZ + 1, &crc, sizeof(crc));
+    if (g_verbose)
+        printf("%.6f host: page request #%u\n", (double)g_now / US, (uint8_t)buff[2]);
+    g_host_busy = 1;
+    host_send_raw(buff, sizeof(buff));
+}
+
+static void download_done(void)
+{
+    g_dl.active = 0;
+    g_dl.done = 1;
+    g_dl.end = g_now;
+    g_dl.data_req_sent = g_pkt_stat[packet_data_req].sent - g_dl.data_req_sent;
+    g_dl.data_sent = g_pkt_stat[packet_data].sent - g_dl.data_sent;
+}
+
+// Verify the data page received
+static void download_page(uint8_t const* data, unsigned len)
+{
+    struct data_page pg;
+    if (len != sizeof(pg))
+        fatal("invalid data page length %u", len);
+    memcpy(&pg, data, sizeof(pg));
+    if (pg.crc != crc32(pg.ibytes, sizeof(pg.ibytes)))
+        fatal("data page %u CRC mismatch", pg.h.page_idx);
+    ++g_dl.pages;
+}
+
+// The stream frame has status, optional data page and CRC32
+static void download_stream_frame(char sep, uint8_t const* data, unsigned len)
+{
+    uint32_t crc;
+    if (sep != 'C' || len < 1 + sizeof(crc))
+        fatal("unexpected data stream frame");
+    len -= sizeof(crc);
+    memcpy(&crc, data + len, sizeof(crc));
+    if (crc != crc32(data, len))
+        fatal("data stream frame CRC mismatch");
+    g_dl.status = data[0];
+    if (len > 1) {
+        download_page(data + 1, len - 1);
+    } else if (g_dl.status == X_COMPLETED || g_dl.status == X_FAILED) {
+        download_done();
+        return;
+    }
+    event_add(g_now + g_host_delay, evt_host_next, NULL, "a");
+}
+
+// The binary response has operation code, request id, error code, status,
+// optional data page and CRC32
+static void download_page_response(char sep, uint8_t const* data, unsigned len)
+{
+    uint32_t crc;
+    if (sep != 'R' || len < BIN_HDR_SZ + 1 + sizeof(crc))
+        fatal("unexpected binary response");
+    len -= sizeof(crc);
+    memcpy(&crc, data + len, sizeof(crc));
+    if (crc != crc32(data, len))
+        fatal("binary response CRC mismatch");
+    if (data[0] != BIN_OP_PAGE || data[1] != g_dl.resp_id++ || data[2])
+        fatal("invalid binary response %u #%u error %u", data[0], data[1], data[2]);
+    data += BIN_HDR_SZ;
+    len -= BIN_HDR_SZ;
+    g_dl.status = data[0];
+    if (len > 1) {
+        download_page(data + 1, len - 1);
+    } else if (g_dl.status == X_COMPLETED || g_dl.status == X_FAILED) {
+        download_done();
+        return;
+    }
+    event_add(g_now + g_host_delay, evt_host_next, NULL, NULL);
+}
+
+static void download_start_transfer(uint64_t delay)
+{
+    g_dl.phase = dl_start;
+    event_add(g_now + delay, evt_host_next, NULL, g_download_cached ? "k0" : "s0");
+}
+
+static void download_response(char sep, uint8_t const* data, unsigned len)
+{
+    int ok = len == 1 && data[0] == '\r';
+    switch (g_dl.phase) {
+    case dl_baud:
+        if (!ok) {
+            // keep the current baud rate
+            download_start_transfer(g_host_delay);
+            return;
+        }
+        // The receiver has switched after the response, so does the host
+        g_dl.prev_baud = g_host_baud;
+        g_host_baud = g_baud < g_host_baud_max ? g_baud : g_host_baud_max;
+        g_dl.phase = dl_verify;
+        event_add(g_now + g_host_delay, evt_host_next, NULL, "v");
+        event_add(g_now + g_host_delay + HOST_TOUT, evt_host_tout, NULL, NULL);
+        return;
+    case dl_verify:
+        if (!ok)
+            fatal("unexpected baud rate confirmation response");
+        download_start_transfer(g_host_delay);
+        return;
+    case dl_start:
+        g_dl.phase = dl_data;
+        if (g_download_pipeline) {
+            unsigned i;
+            for (i = 0; i < g_download_pipeline; ++i)
+                event_add(g_now + g_host_delay, evt_host_next, NULL, NULL);
+            return;
+        }
+        event_add(g_now + g_host_delay, evt_host_next, NULL, g_download_poll ? "qd0" : "p0");
+        return;
+    }
+    if (g_download_pipeline) {
+        download_page_response(sep, data, len);
+        return;
+    }
+    if (!g_download_poll) {
+        download_stream_frame(sep, data, len);
+        return;
+    }
+    if (sep != 'B' || !len)
+        fatal("unexpected data page query response");
+    g_dl.status = data[0];
+    if (len > 1) {
+        download_page(data + 1, len - 1);
+    } else if (g_dl.status == X_COMPLETED || g_dl.status == X_FAILED) {
+        download_done();
+        return;
+    }
+    event_add(g_now + g_host_delay, evt_host_next, NULL, "qd0");
+}
+
+static void host_response(char sep, uint8_t const* data, unsigned len)
+{
+    static int part; // the previous frame was the response part
+    g_host_busy = sep == FRAME_PART;
+    if (g_dl.active) {
+        download_response(sep, data, len);
+    } else if (sep == 'R') {
+        // the pipelined requests outstanding at the download end
+    } else {
+        unsigned i;
+        if (!part)
+            printf("%.6f %s:\n", (double)g_now / US, g_host_cmd);
+        for (i = 0; i < len; ++i)
+            putchar(data[i] == '\r' ? '\n' : data[i]);
+        if (len && data[len-1] != '\r' && sep != FRAME_PART)
+            putchar('\n');
+    }
+    part = sep == FRAME_PART;
+}
+
+// Parse receiver output framed as ~LLLLx<data>
+static void host_input(uint8_t const* data, unsigned len)
+{
+    if (g_host_baud != g_uart_baud) {
+        if (g_verbose)
+            printf("%.6f host: %u bytes lost on baud rate mismatch\n", (double)g_now / US, len);
+        return;
+    }
+    if (g_host_len + len > sizeof(g_host_buff))
+        fatal("host buffer overflow");
+    memcpy(g_host_buff + g_host_len, data, len);
+    g_host_len += len;
+    while (g_host_len >= FRAME_HDR_SZ) {
+        char hdr[FRAME_HDR_SZ];
+        unsigned frame_len;
+        if (g_host_buff[0] != '~')
+            fatal("invalid frame from receiver");
+        memcpy(hdr, g_host_buff + 1, 4);
+        hdr[4] = 0;
+        frame_len = strtoul(hdr, NULL, 16);
+        if (g_host_len < FRAME_HDR_SZ + frame_len)
+            return;
+        host_response(g_host_buff[FRAME_HDR_SZ-1], g_host_buff + FRAME_HDR_SZ, frame_len);
+        g_host_len -= FRAME_HDR_SZ + frame_len;
+        memmove(g_host_buff, g_host_buff + FRAME_HDR_SZ + frame_len, g_host_len);
+    }
+}
+
+static void host_start_download(void)
+{
+    g_dl.active = 1;
+    g_dl.start = g_now;
+    g_dl.data_req_sent = g_pkt_stat[packet_data_req].sent;
+    g_dl.data_sent = g_pkt_stat[packet_data].sent;
+    if (g_baud) {
+        static char cmd[16];
+        snprintf(cmd, sizeof(cmd), "b%u", g_baud);
+        g_dl.phase = dl_baud;
+        host_send(cmd);
+    } else {
+        g_dl.phase = dl_start;
+        host_send(g_download_cached ? "k0" : "s0");
+    }
+}
+
+// The response was not received in time
+static void host_timeout(void)
+{
+    if (g_dl.active && g_dl.phase == dl_verify) {
+        // Restore the baud rate and wait for the receiver to do the same
+        g_host_busy = 0;
+        g_host_baud = g_dl.prev_baud;
+        if (g_verbose)
+            printf("%.6f host: baud rate switch failed\n", (double)g_now / US);
+        download_start_transfer(BAUD_RESTORE_TOUT);
+    }
+}
+
+//----- Main --------------------------------------------
+
+static void handle_event(int i)
+{
+    struct event e = g_events[i];
+    g_events[i] = g_events[--g_nevents];
+    switch (e.type) {
+    case evt_air_start:
+        air_start(e.pkt);
+        break;
+    case evt_air_address:
+        air_address(e.pkt);
+        break;
+    case evt_air_end:
+        air_end(e.pkt);
+        break;
+    case evt_host_cmd:
+        if (g_host_busy || g_dl.active)
+            // postpone till the current command is completed
+            event_add(g_now + g_host_delay, e.type, NULL, e.cmd);
+        else if (e.cmd)
+            host_send(e.cmd);
+        else
+            host_start_download();
+        break;
+    case evt_host_next:
+        if (e.cmd)
+            host_send(e.cmd);
+        else
+            host_send_page_req();
+        break;
+    case evt_host_tout:
+        host_timeout();
+        break;
+    case evt_tx_restart:
+        node_restart(&g_nodes[node_tx]);
+        break;
+    }
+}
+
+static void print_stat(void)
+{
+    int i;
+    printf("simulated %.3f sec\n", (double)g_now / US);
+    // Missed packets were sent while there were no receiver listening the channel
+    printf("%-10s %8s %8s %8s %8s %8s\n", "packets", "sent", "received", "lost", "corrupted", "missed");
+    for (i = 0; i <= PKT_TYPES; ++i) {
+        struct pkt_stat const* st = &g_pkt_stat[i];
+        if (!st->sent)
+            continue;
+        printf("%-10s %8u %8u %8u %8u %8u\n", i < PKT_TYPES ? g_pkt_names[i] : "invalid",
+            st->sent, st->received, st->lost, st->corrupted,
+            st->sent - st->received - st->lost - st->corrupted);
+    }
+    for (i = 0; i <= PKT_TYPES; ++i) {
+        if (g_pkt_stat[i].bit_errors)
+            printf("%u %s packets received with undetected bit errors\n", g_pkt_stat[i].bit_errors,
+                i < PKT_TYPES ? g_pkt_names[i] : "invalid");
+    }
+    if (g_now) {
+        struct node* n = &g_nodes[node_rx];
+        node_rx_off(n);
+        printf("receiver enabled %.2f%% of time\n", 100. * n->rx_time / g_now);
+    }
+    if (g_download) {
+        if (!g_dl.done) {
+            printf("download not completed, %u pages received\n", g_dl.pages);
+            return;
+        }
+        printf("download %s in %.3f sec at %u baud: %u pages",
+            g_dl.status == X_COMPLETED ? "completed" : "failed",
+            (double)(g_dl.end - g_dl.start) / US, g_host_baud, g_dl.pages);
+        if (g_dl.pages) {
+            printf(", %.2f fragments and %.2f data requests per page",
+                (double)g_dl.data_sent / g_dl.pages, (double)g_dl.data_req_sent / g_dl.pages);
+        }
+        printf("\n");
+    }
+}
+
+static void parse_chan_loss(const char* arg)
+{
+    while (*arg) {
+        char* end;
+        unsigned ch = strtoul(arg, &end, 10);
+        if (*end != ':' || ch > MAX_CHANNEL)
+            fatal("invalid channel loss specification");
+        g_chan_loss[ch] = strtod(end + 1, &end);
+        if (*end == ',')
+            ++end;
+        arg = end;
+    }
+}
+
+static void parse_cmd(const char* arg)
+{
+    char* end;
+    if (g_ncmds >= MAX_CMDS)
+        fatal("too many commands");
+    g_cmds[g_ncmds].time = strtod(arg, &end) * US;
+    if (*end != ':')
+        fatal("invalid command specification");
+    g_cmds[g_ncmds++].cmd = end + 1;
+}
+
+static void parse_opts(int argc, char** argv)
+{
+    int i, ch;
+    for (i = 1; i < argc; ++i) {
+        const char* a = argv[i];
+        if (!strncmp(a, "--time=", 7)) {
+            g_end_time = strtod(a + 7, NULL) * US;
+        } else if (!strncmp(a, "--seed=", 7)) {
+            g_seed = strtoull(a + 7, NULL, 0);
+        } else if (!strncmp(a, "--bitrate=", 10)) {
+            g_bitrate = strtoul(a + 10, NULL, 0);
+        } else if (!strncmp(a, "--loss=", 7)) {
+            for (ch = 0; ch <= MAX_CHANNEL; ++ch)
+                g_chan_loss[ch] = strtod(a + 7, NULL);
+        } else if (!strncmp(a, "--latency=", 10)) {
+            g_latency = strtoull(a + 10, NULL, 0);
+        } else if (!strncmp(a, "--bit-errors=", 13)) {
+            g_bit_errors = strtod(a + 13, NULL);
+        } else if (!strncmp(a, "--chan-loss=", 12)) {
+            parse_chan_loss(a + 12);
+        } else if (!strcmp(a, "--download")) {
+            g_download = 1;
+        } else if (!strncmp(a, "--download=", 11)) {
+            g_download = 1;
+            g_download_time = strtod(a + 11, NULL) * US;
+        } else if (!strcmp(a, "--poll")) {
+            g_download_poll = 1;
+        } else if (!strncmp(a, "--pipeline=", 11)) {
+            g_download_pipeline = strtoul(a + 11, NULL, 10);
+        } else if (!strcmp(a, "--cached")) {
+            g_download_cached = 1;
+        } else if (!strncmp(a, "--baud=", 7)) {
+            g_baud = strtoul(a + 7, NULL, 10);
+        } else if (!strncmp(a, "--host-baud-max=", 16)) {
+            g_host_baud_max = strtoul(a + 16, NULL, 10);
+        } else if (!strncmp(a, "--host-delay=", 13)) {
+            g_host_delay = strtod(a + 13, NULL) * 1000;
+        } else if (!strncmp(a, "--cmd=", 6)) {
+            parse_cmd(a + 6);
+        } else if (!strncmp(a, "--power=", 8)) {
+            g_power = a + 8;
+        } else if (!strncmp(a, "--vbatt=", 8)) {
+            g_vbatt = a + 8;
+        } else if (!strncmp(a, "--tx-restart=", 13)) {
+            g_tx_restart_time = strtod(a + 13, NULL) * US;
+        } else if (!strcmp(a, "-v")) {
+            g_verbose = 1;
+        } else {
+            fprintf(stderr, "invalid option %s, see sim.c for usage\n", a);
+            exit(1);
+        }
+    }
+    if (!g_seed || !g_bitrate)
+        fatal("seed and bitrate should be non zero");
+}
+
+int main(int argc, char** argv)
+{
+    char path[4096];
+    unsigned i;
+
+    parse_opts(argc, argv);
+    signal(SIGPIPE, SIG_IGN);
+
+    for (i = 0; i < g_ncmds; ++i)
+        event_add(g_cmds[i].time, evt_host_cmd, NULL, g_cmds[i].cmd);
+    if (g_download)
+        event_add(g_download_time, evt_host_cmd, NULL, NULL);
+    if (g_tx_restart_time)
+        event_add(g_tx_restart_time, evt_tx_restart, NULL, NULL);
+
+    for (i = 0; i < node_count; ++i) {
+        snprintf(path, sizeof(path), "%s", argv[0]);
+        char* dir = dirname(path);
+        char node_path[4200];
+        snprintf(node_path, sizeof(node_path), "%s/sim_%s", dir, g_nodes[i].name);
+        g_nodes[i].path = strdup(node_path);
+        node_start(&g_nodes[i], node_path);
+    }
+
+    for (;;) {
+        int e = event_first();
+        struct node* n = &g_nodes[0];
+        for (i = 1; i < node_count; ++i) {
+            if (g_nodes[i].deadline < n->deadline)
+                n = &g_nodes[i];
+        }
+        if (e >= 0 && g_events[e].time <= n->deadline) {
+            if (g_events[e].time > g_end_time)
+                break;
+            g_now = g_events[e].time;
+            handle_event(e);
+        } else {
+            if (n->deadline > g_end_time)
+                break;
+            g_now = n->deadline;
+            node_wake(n, ev_none, 0, NULL, 0);
+        }
+        if (g_download && g_dl.done && !g_ncmds)
+            break;
+    }
+
+    print_stat();
+    cleanup();
+    return 0;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+//
+// Link simulator interface between the master process and the nodes.
+//
+// Every node (transmitter or receiver firmware built against the stand-in
+// headers in include/) runs in its own process connected to the master by
+// a socket. The master owns the virtual time and the air. Only one node runs
+// at any moment, it runs until it has to wait and then sends msg_wait
+// telling the master the time of its next local event. The master wakes up
+// the node whose event comes first, so the whole simulation is deterministic.
+//
+
+#include <stdint.h>
+
+#define SIM_FOREVER (~(uint64_t)0)
+
+// Environment variables passed to nodes
+#define SIM_ENV_FD      "SIM_FD"
+#define SIM_ENV_BITRATE "SIM_BITRATE"
+#define SIM_ENV_TIME    "SIM_TIME" // node start time, us
+
+typedef enum {
+    // node -> master
+    msg_wait,      // time = wake up deadline
+    msg_tx,        // arg = channel, data = packet
+    msg_rx_on,     // arg = channel
+    msg_rx_off,
+    msg_uart_tx,   // data = bytes sent to host
+    msg_uart_baud, // data = uint32_t baud rate
+    msg_log,       // data = text
+    msg_fatal,     // data = text
+    // master -> node
+    msg_wake,      // time = current time, arg = event type
+} sim_msg_type_t;
+
+// Events delivered with msg_wake
+typedef enum {
+    ev_none,
+    ev_rx_address, // packet address received
+    ev_rx_end,     // flags = SIM_CRC_OK if not corrupted, data = packet
+    ev_uart_rx,    // data = bytes from host
+} sim_event_t;
+
+#define SIM_CRC_OK 1
+
+struct sim_msg_hdr {
+    uint16_t type;
+    uint16_t len;   // data length
+    uint16_t arg;
+    uint16_t flags;
+    uint64_t time;  // usec
+};
+
+#define SIM_MSG_MAX_DATA 1024
+
+struct sim_msg {
+    struct sim_msg_hdr h;
+    uint8_t            data[SIM_MSG_MAX_DATA];
+};
+
+// Radio timing
+#define SIM_RADIO_RAMP_US     130 // TXEN / RXEN ramp up
+#define SIM_RADIO_OVERHEAD_SZ 8   // preamble, address and CRC
+#define SIM_RADIO_ADDR_SZ     6   // preamble and address
+
+static inline uint64_t sim_bytes_time(unsigned sz, unsigned bitrate)
+{
+    return ((uint64_t)sz * 8 * 1000000 + bitrate - 1) / bitrate;
+}
+
+// Packet transmission time
+static inline uint64_t sim_airtime(unsigned sz, unsigned bitrate)
+{
+    return sim_bytes_time(sz + SIM_RADIO_OVERHEAD_SZ, bitrate);
+}